@@ -0,0 +1,139 @@
+/* an example program using libdanknn (sam's Dank Neural Network library)
+ * to train one network data-parallel across several processes on the
+ * local machine, each process fitting its own shard of a toy regression
+ * problem and all of them agreeing on the weights after every step
+ *
+ * Copyright Sam Popham, 2020
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "../../src/danknn_intern.h"
+
+#define NUM_WORKERS	4
+#define BASE_PORT	47100
+#define NUM_EXAMPLES	4096
+#define NUM_EPOCHS	50
+#define BATCH_SIZE	8
+
+/* every worker generates the same dataset and trains on the examples
+ * whose index is congruent to its rank */
+static void make_example(int i, float *inp, float *want)
+{
+	inp[0] = (float)(i % 64) / 32 - 1;
+	inp[1] = (float)(i / 64) / 32 - 1;
+	want[0] = sin(3 * inp[0]) * cos(3 * inp[1]) / 2 + 0.5;
+}
+
+static int worker(int rank, int world_size)
+{
+	int i, b, e;
+	int n_local;
+	float inp[2], want[1];
+	float *output;
+	double mse, checksum;
+
+	struct dnn_net *net;
+	struct dnn_dist *dist;
+	struct dnn_train *train[BATCH_SIZE];
+
+	static int layer_shapes[] = {2, 32, 32, 1};
+
+	net = dnn_create_network(sizeof layer_shapes / sizeof *layer_shapes, layer_shapes);
+	dnn_init_net(net);
+
+	dist = dnn_dist_create(net, rank, world_size, "localhost", BASE_PORT);
+	if(!dist){
+		printf("rank %d: couldn't join the ring\n", rank);
+		return -1;
+	}
+	/* every rank initialized differently, start from rank 0's weights */
+	dnn_dist_bcast_net(dist);
+
+	for(i = 0; i < BATCH_SIZE; ++i){
+		train[i] = dnn_create_train(net);
+		dnn_dist_attach(dist, train[i]);
+	}
+
+	n_local = NUM_EXAMPLES / world_size;
+	for(e = 0; e < NUM_EPOCHS; ++e){
+		for(b = 0; b + BATCH_SIZE <= n_local; b += BATCH_SIZE){
+			for(i = 0; i < BATCH_SIZE; ++i){
+				make_example((b + i) * world_size + rank, inp, want);
+				dnn_train(inp, want, train[i]);
+			}
+			if(dnn_dist_apply(dist, 0.05)){
+				printf("rank %d: gradient exchange failed\n", rank);
+				return -1;
+			}
+		}
+	}
+
+	mse = 0;
+	for(i = 0; i < NUM_EXAMPLES; ++i){
+		make_example(i, inp, want);
+		output = dnn_test(net, inp);
+		mse += (output[0] - want[0]) * (output[0] - want[0]) / NUM_EXAMPLES;
+		free(output);
+	}
+
+	/* replicas should be bit-identical, compare a checksum of them */
+	checksum = 0;
+	for(i = 0; i < net->num_lays - 1; ++i)
+		for(b = 0; b < net->lay_sizes[i] * net->lay_sizes[i + 1]; ++b)
+			checksum += net->lays[i].wm_alloc_handle[b] * (b % 7 + 1);
+
+	printf("rank %d: mse %f, weight checksum %.9f\n", rank, mse, checksum);
+
+	dnn_dist_destroy(dist);
+	for(i = 0; i < BATCH_SIZE; ++i)
+		dnn_destroy_train(train[i]);
+	dnn_destroy_net(net);
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int i;
+	int world_size;
+	int status;
+	int err;
+
+	world_size = argc > 1 ? atoi(argv[1]) : NUM_WORKERS;
+	if(world_size < 1){
+		puts("usage: ./dist [num_workers]");
+		return -1;
+	}
+
+	for(i = 0; i < world_size; ++i){
+		if(fork() == 0)
+			return worker(i, world_size) ? 1 : 0;
+	}
+
+	err = 0;
+	for(i = 0; i < world_size; ++i){
+		wait(&status);
+		if(!WIFEXITED(status) || WEXITSTATUS(status))
+			err = -1;
+	}
+
+	return err;
+}
@@ -219,9 +219,8 @@ int main()
 	pthread_t thread[NUM_THREADS];
 	struct thread_data thread_data[NUM_THREADS];
 
-	float *output;
-	float max_output;
-	int guess;
+	struct dnn_eval *eval;
+	int *labels;
 	float accuracy;
 
 	static int layer_shapes[] = {0, 256, 128, 10};
@@ -235,6 +234,8 @@ int main()
 
 	net = dnn_create_network(sizeof layer_shapes / sizeof *layer_shapes, layer_shapes);
 	dnn_init_net(net);
+	// 10-way classifier, softmax outputs trained on cross entropy
+	dnn_set_output(net, DNN_OUT_SOFTMAX);
 
 	train = malloc(sizeof *train * NUM_THREADS * BATCH_SIZE);
 	for(i = 0; i < NUM_THREADS * BATCH_SIZE; ++i)
@@ -287,33 +288,29 @@ int main()
 
 	test_data = load_dataset(TEST_DATA, TEST_LABEL);
 
-	guess = 0;
-	accuracy = 0;
+	labels = malloc(sizeof *labels * test_data->data_size[0]);
+	for(i = 0; i < test_data->data_size[0]; ++i)
+		labels[i] = test_data->label[i];
+
 	printf("testing on the testing database...\n");
-	for(i = 0; i < test_data->data_size[0]; ++i){
-		output = dnn_test(net, test_data->data[i]);
-		/*
-		   for(a = 0; a < 10; ++a)
-		   printf("%1.3f ", output[a]);
-		   putchar('\n');
-		   printf("labelled value: %i\n", test_data->label[rand_sel]);
-		   */
-
-		// determining accuracy
-		max_output = 0;
-		for(a = 0; a < 10; ++a){
-			if(output[a] > max_output){
-				max_output = output[a];
-				guess = a;
-			}
-		}
-		// printf("network_guess: %i\n", guess);
-		if(guess == test_data->label[i])
-			accuracy += 1.0/test_data->data_size[0];
+	eval = dnn_evaluate(net, test_data->data, labels, test_data->data_size[0],
+			DNN_METRIC_XENT, NUM_THREADS);
+	if(!eval){
+		puts("evaluation failed");
+		return -1;
+	}
+	accuracy = eval->accuracy;
 
-		free(output);
+	// confusion matrix, rows are labels and columns are guesses
+	for(i = 0; i < eval->n_classes; ++i){
+		for(a = 0; a < eval->n_classes; ++a)
+			printf("%5d ", eval->confusion[i * eval->n_classes + a]);
+		putchar('\n');
 	}
+	printf("mean loss: %f\n", eval->mean_loss);
 
+	dnn_destroy_eval(eval);
+	free(labels);
 	destroy_dataset(test_data);
 
 	printf("accuracy: %f\n", accuracy);
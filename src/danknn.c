@@ -44,10 +44,22 @@ float dnn_d_act_swish(float x)
 	return dnn_act_swish(x) + dnn_act_sigmoid(x) * (1 - dnn_act_swish(x));
 }
 
-/* TODO: implement APTx activation function [https://arxiv.org/ftp/arxiv/papers/2209/2209.06119.pdf]
-  * suchthat all params are trainable*/
-float dnn_act_aptx(float x){}
-float dnn_d_act_aptx(float x){}
+/* APTx activation function [https://arxiv.org/ftp/arxiv/papers/2209/2209.06119.pdf]
+ * aptx(x) = (alpha + tanh(beta * x)) * gamma * x, these two use the paper's
+ * alpha = 1, beta = 1, gamma = 1/2 which approximate mish, layers set with
+ * dnn_set_act_aptx() train their own parameters instead */
+float dnn_act_aptx(float x)
+{
+	return (1 + tanhf(x)) * x / 2;
+}
+
+float dnn_d_act_aptx(float x)
+{
+	float t;
+
+	t = tanhf(x);
+	return (1 + t) / 2 + x * (1 - t * t) / 2;
+}
 
 struct dnn_net *dnn_create_network(int num_lays, int *lay_sizes)
 {
@@ -64,22 +76,75 @@ struct dnn_net *dnn_create_network(int num_lays, int *lay_sizes)
 	/* no need to allocate biases or weights for input "layer" */
 
 	net->num_lays = num_lays;
+	net->out_mode = DNN_OUT_ACT;
+	net->n_dist = 0;
 	net->lay_sizes = malloc(sizeof *net->lay_sizes * num_lays);
 	for(i = 0; i < num_lays; ++i)
 		net->lay_sizes[i] = lay_sizes[i];
 
 	for(i = 0; i < num_lays - 1; ++i){
-		net->lays[i].wm_alloc_handle = malloc(sizeof *net->lays[i].wm_alloc_handle * lay_sizes[i] * lay_sizes[i + 1]);
+		net->lays[i].wm_alloc_handle = dnn_alloc_buf(sizeof *net->lays[i].wm_alloc_handle * lay_sizes[i] * lay_sizes[i + 1]);
 		net->lays[i].wm = malloc(sizeof *net->lays[i].wm * lay_sizes[i + 1]);
 		for(j = 0; j < lay_sizes[i + 1]; ++j)
 			net->lays[i].wm[j] = &net->lays[i].wm_alloc_handle[lay_sizes[i] * j];
 		net->lays[i].bias = malloc(sizeof *net->lays[i].bias * lay_sizes[i + 1]);
 		net->lays[i].actv_func = &dnn_act_swish;
+		/* only training needs the transposed copy, see dnn_create_train() */
+		net->lays[i].wm_t = NULL;
+		net->lays[i].kern = 0;
+		net->lays[i].row_block = 0;
+		net->lays[i].aptx = NULL;
+		net->lays[i].n_aptx = 0;
+		net->lays[i].rank = 0;
+		net->lays[i].lr_u = NULL;
+		net->lays[i].lr_v = NULL;
 	}
 
 	return net;
 }
 
+/* block size of the transpose, two TRANSPOSE_BLOCK^2 float tiles fit in l1 */
+#define TRANSPOSE_BLOCK	32
+
+/* rewrites wm_t of layer lay from wm, blocked so both the reads and the
+ * writes stay within a few cache lines and pages at a time */
+void dnn_pack_layer(struct dnn_net *net, int lay)
+{
+	int j, k, jb, kb;
+	int j_end, k_end;
+	int n_in, n_out;
+	float *wt;
+
+	wt = net->lays[lay].wm_t;
+	if(!wt)
+		return;
+	n_in = net->lay_sizes[lay];
+	n_out = net->lay_sizes[lay + 1];
+
+	for(jb = 0; jb < n_out; jb += TRANSPOSE_BLOCK){
+		j_end = jb + TRANSPOSE_BLOCK < n_out ? jb + TRANSPOSE_BLOCK : n_out;
+		for(kb = 0; kb < n_in; kb += TRANSPOSE_BLOCK){
+			k_end = kb + TRANSPOSE_BLOCK < n_in ? kb + TRANSPOSE_BLOCK : n_in;
+			for(j = jb; j < j_end; ++j)
+				for(k = kb; k < k_end; ++k)
+					wt[k * n_out + j] = net->lays[lay].wm[j][k];
+		}
+	}
+}
+
+int dnn_repack_net(struct dnn_net *net)
+{
+	int i;
+
+	if(!net)
+		return -1;
+
+	for(i = 0; i < net->num_lays - 1; ++i)
+		dnn_pack_layer(net, i);
+
+	return 0;
+}
+
 int dnn_set_act_func(struct dnn_net *net, int lay_num, float (*actv_func)(float x))
 {
 	if(!net)
@@ -91,10 +156,119 @@ int dnn_set_act_func(struct dnn_net *net, int lay_num, float (*actv_func)(float
 	 * rlly just the rowsize of internal layer 1, which is
 	 * stored in net->lays[0] */
 	net->lays[lay_num - 1].actv_func = actv_func;
+	/* drop any trainable activation in favour of the function */
+	free(net->lays[lay_num - 1].aptx);
+	net->lays[lay_num - 1].aptx = NULL;
+	net->lays[lay_num - 1].n_aptx = 0;
 
 	return 0;
 }
 
+int dnn_set_act_aptx(struct dnn_net *net, int lay_num, int per_neuron)
+{
+	int i;
+	int n;
+	float *aptx;
+
+	if(!net)
+		return -1;
+	if(lay_num <= 0 || lay_num >= net->num_lays)
+		return -1;
+
+	n = per_neuron ? net->lay_sizes[lay_num] : 1;
+	aptx = malloc(sizeof *aptx * 3 * n);
+	if(!aptx)
+		return -1;
+	for(i = 0; i < n; ++i){
+		aptx[i] = 1;
+		aptx[n + i] = 1;
+		aptx[2 * n + i] = 0.5;
+	}
+
+	free(net->lays[lay_num - 1].aptx);
+	net->lays[lay_num - 1].aptx = aptx;
+	net->lays[lay_num - 1].n_aptx = n;
+	net->lays[lay_num - 1].actv_func = &dnn_act_aptx;
+
+	return 0;
+}
+
+int dnn_set_output(struct dnn_net *net, int out_mode)
+{
+	if(!net)
+		return -1;
+	if(out_mode != DNN_OUT_ACT && out_mode != DNN_OUT_SOFTMAX)
+		return -1;
+
+	net->out_mode = out_mode;
+
+	return 0;
+}
+
+/* numerically stable softmax, the max is subtracted before exp() so no
+ * logit can overflow, each pass is a plain loop over the layer */
+void dnn_softmax(const float *z, float *p, int n)
+{
+	int i;
+	float max, sum, inv;
+
+	max = z[0];
+	for(i = 1; i < n; ++i)
+		max = z[i] > max ? z[i] : max;
+
+	sum = 0;
+	for(i = 0; i < n; ++i){
+		p[i] = expf(z[i] - max);
+		sum += p[i];
+	}
+
+	inv = 1 / sum;
+	for(i = 0; i < n; ++i)
+		p[i] *= inv;
+}
+
+/* trainable APTx over a whole layer, one set of parameters per neuron or,
+ * with n_prm == 1, one shared by the layer, no calls through a pointer
+ * or to tanhf() so both loops vectorize */
+void dnn_aptx_forward(const float *prm, int n_prm, const float *z, float *a, int n)
+{
+	int j;
+	const float *alpha, *beta, *gamma;
+
+	alpha = prm;
+	beta = &prm[n_prm];
+	gamma = &prm[2 * n_prm];
+
+	if(n_prm == 1){
+		for(j = 0; j < n; ++j)
+			a[j] = (alpha[0] + dnn_tanh(beta[0] * z[j])) * gamma[0] * z[j];
+		return;
+	}
+	for(j = 0; j < n; ++j)
+		a[j] = (alpha[j] + dnn_tanh(beta[j] * z[j])) * gamma[j] * z[j];
+}
+
+/* a = activation of net->lays[lay] applied to its weighted sums z, may be
+ * done in place */
+void dnn_activate(struct dnn_net *net, int lay, const float *z, float *a)
+{
+	int j;
+
+	if(lay == net->num_lays - 2 && net->out_mode == DNN_OUT_SOFTMAX){
+		dnn_softmax(z, a, net->lay_sizes[lay + 1]);
+		return;
+	}
+
+	if(net->lays[lay].n_aptx){
+		dnn_aptx_forward(net->lays[lay].aptx, net->lays[lay].n_aptx,
+				z, a, net->lay_sizes[lay + 1]);
+		return;
+	}
+
+	for(j = 0; j < net->lay_sizes[lay + 1]; ++j)
+		a[j] = net->lays[lay].actv_func(z[j]);
+}
+
 int dnn_set_d_act_func(struct dnn_train *train, int lay_num,
 		float (*d_actv_func)(float x))
 {
@@ -120,7 +294,11 @@ int dnn_destroy_net(struct dnn_net *net)
 	for(i = 0; i < net->num_lays - 1; ++i){
 		free(net->lays[i].bias);
 		free(net->lays[i].wm);
-		free(net->lays[i].wm_alloc_handle);
+		dnn_free_buf(net->lays[i].wm_alloc_handle);
+		dnn_free_buf(net->lays[i].wm_t);
+		free(net->lays[i].aptx);
+		dnn_free_buf(net->lays[i].lr_u);
+		dnn_free_buf(net->lays[i].lr_v);
 	}
 
 	free(net->lay_sizes);
@@ -136,23 +314,41 @@ float dnn_d_cost_mse(float out, float want)
 	return 2 * (out - want);
 }
 
-struct dnn_train *dnn_create_train(struct dnn_net *net)
+/* allocates the activation and gradient buffers of train in its current
+ * precision, d_bias always stays fp32 */
+static int train_alloc_bufs(struct dnn_train *train)
 {
 	int i, j;
-	struct dnn_train *train;
-
-	train = malloc(sizeof *train);
-	train->net = net;
-
-	train->d_lays = malloc(sizeof *train->d_lays * net->num_lays);
+	int err;
+	struct dnn_net *net;
+	struct dnn_d_layer *d_lay;
+
+	net = train->net;
+	err = 0;
+
+	if(train->precision == DNN_PREC_BF16){
+		for(i = 0; i < net->num_lays; ++i){
+			d_lay = &train->d_lays[i];
+			d_lay->bf_act = malloc(sizeof *d_lay->bf_act * net->lay_sizes[i]);
+			d_lay->bf_d_act = malloc(sizeof *d_lay->bf_d_act * net->lay_sizes[i]);
+			err |= !d_lay->bf_act || !d_lay->bf_d_act;
+			if(i == 0)
+				continue;
+			d_lay->bf_wtd_sum = malloc(sizeof *d_lay->bf_wtd_sum * net->lay_sizes[i]);
+			d_lay->bf_d_wtd_sum = malloc(sizeof *d_lay->bf_d_wtd_sum * net->lay_sizes[i]);
+			d_lay->bf_d_wm = dnn_alloc_buf(sizeof *d_lay->bf_d_wm *
+					net->lay_sizes[i - 1] * net->lay_sizes[i]);
+			err |= !d_lay->bf_wtd_sum || !d_lay->bf_d_wtd_sum || !d_lay->bf_d_wm;
+		}
+		return err ? -1 : 0;
+	}
 
 	train->d_lays[0].act = malloc(sizeof *train->d_lays[0].act
 			* net->lay_sizes[0]);
 	train->d_lays[0].d_act = malloc(sizeof *train->d_lays[0].d_act
 			* net->lay_sizes[0]);
+	err |= !train->d_lays[0].act || !train->d_lays[0].d_act;
 	for(i = 1; i < net->num_lays; ++i){
-		train->d_lays[i].d_bias = malloc(sizeof *train->d_lays[i].d_bias *
-				net->lay_sizes[i]);
 		train->d_lays[i].wtd_sum = malloc(sizeof *train->d_lays[i].wtd_sum *
 				net->lay_sizes[i]);
 		train->d_lays[i].d_wtd_sum = malloc(sizeof *train->d_lays[i].d_wtd_sum *
@@ -163,17 +359,139 @@ struct dnn_train *dnn_create_train(struct dnn_net *net)
 				net->lay_sizes[i]);
 		train->d_lays[i].d_wm = malloc(sizeof *train->d_lays[i].d_wm *
 				net->lay_sizes[i]);
-		train->d_lays[i].d_wm_alloc_handle = malloc(sizeof
+		train->d_lays[i].d_wm_alloc_handle = dnn_alloc_buf(sizeof
 				*train->d_lays[i].d_wm_alloc_handle *
 				net->lay_sizes[i - 1] * net->lay_sizes[i]);
+		if(!train->d_lays[i].d_wm || !train->d_lays[i].d_wm_alloc_handle){
+			err = 1;
+			continue;
+		}
 		for(j = 0; j < net->lay_sizes[i]; ++j)
 			train->d_lays[i].d_wm[j] = &train->d_lays[i].d_wm_alloc_handle[j * net->lay_sizes[i - 1]];
-		train->d_lays[i].d_actv_func = &dnn_d_act_swish;
+		err |= !train->d_lays[i].wtd_sum || !train->d_lays[i].d_wtd_sum ||
+			!train->d_lays[i].act || !train->d_lays[i].d_act;
+	}
+
+	return err ? -1 : 0;
+}
+
+static void train_free_bufs(struct dnn_train *train)
+{
+	int i;
+	struct dnn_d_layer *d_lay;
+
+	for(i = 0; i < train->net->num_lays; ++i){
+		d_lay = &train->d_lays[i];
+		free(d_lay->wtd_sum);
+		free(d_lay->d_wtd_sum);
+		free(d_lay->act);
+		free(d_lay->d_act);
+		free(d_lay->d_wm);
+		dnn_free_buf(d_lay->d_wm_alloc_handle);
+		free(d_lay->bf_wtd_sum);
+		free(d_lay->bf_d_wtd_sum);
+		free(d_lay->bf_act);
+		free(d_lay->bf_d_act);
+		dnn_free_buf(d_lay->bf_d_wm);
+
+		d_lay->wtd_sum = d_lay->d_wtd_sum = NULL;
+		d_lay->act = d_lay->d_act = NULL;
+		d_lay->d_wm = NULL;
+		d_lay->d_wm_alloc_handle = NULL;
+		d_lay->bf_wtd_sum = d_lay->bf_d_wtd_sum = NULL;
+		d_lay->bf_act = d_lay->bf_d_act = NULL;
+		d_lay->bf_d_wm = NULL;
+	}
+}
+
+struct dnn_train *dnn_create_train(struct dnn_net *net)
+{
+	int i;
+	char *fresh;
+	struct dnn_train *train;
+
+	if(!net)
+		return NULL;
+
+	/* which layers get their wm_t here, so a failure can take them back
+	 * and leave net as it was */
+	fresh = calloc(net->num_lays, sizeof *fresh);
+	if(!fresh)
+		return NULL;
+
+	/* the backward pass reads the weights column by column, give it a
+	 * transposed copy so those reads are unit stride too */
+	for(i = 0; i < net->num_lays - 1; ++i){
+		if(net->lays[i].wm_t || net->lays[i].rank)
+			continue;
+		net->lays[i].wm_t = dnn_alloc_buf(sizeof *net->lays[i].wm_t *
+				net->lay_sizes[i] * net->lay_sizes[i + 1]);
+		if(!net->lays[i].wm_t)
+			goto fail;
+		fresh[i] = 1;
+		dnn_pack_layer(net, i);
+	}
+
+	train = calloc(1, sizeof *train);
+	if(!train)
+		goto fail;
+	train->net = net;
+
+	/* zeroed so buffers belonging to the other precision are NULL */
+	train->d_lays = calloc(net->num_lays, sizeof *train->d_lays);
+	if(!train->d_lays){
+		free(train);
+		goto fail;
 	}
 
+	train->precision = DNN_PREC_FP32;
+	train->loss_scale = 1;
 	train->d_cost = &dnn_d_cost_mse;
+	train->dist = NULL;
+
+	for(i = 1; i < net->num_lays; ++i){
+		train->d_lays[i].d_bias = malloc(sizeof *train->d_lays[i].d_bias *
+				net->lay_sizes[i]);
+		train->d_lays[i].d_actv_func = &dnn_d_act_swish;
+		if(!train->d_lays[i].d_bias)
+			break;
+	}
+	if(i < net->num_lays || train_alloc_bufs(train)){
+		dnn_destroy_train(train);
+		goto fail;
+	}
+
+	free(fresh);
 
 	return train;
+
+fail:
+	for(i = 0; i < net->num_lays - 1; ++i){
+		if(!fresh[i])
+			continue;
+		dnn_free_buf(net->lays[i].wm_t);
+		net->lays[i].wm_t = NULL;
+	}
+	free(fresh);
+
+	return NULL;
+}
+
+int dnn_set_train_precision(struct dnn_train *train, int precision, float loss_scale)
+{
+	if(!train)
+		return -1;
+	if(precision != DNN_PREC_FP32 && precision != DNN_PREC_BF16)
+		return -1;
+	if(loss_scale < 0 || (precision == DNN_PREC_FP32 && loss_scale > 0 && loss_scale != 1))
+		return -1;
+	train->loss_scale = loss_scale > 0 ? loss_scale : 1;
+	if(precision == train->precision)
+		return 0;
+
+	train_free_bufs(train);
+	train->precision = precision;
+	return train_alloc_bufs(train);
 }
 
 int dnn_set_d_cost_func(struct dnn_train *train,
@@ -189,16 +507,14 @@ int dnn_destroy_train(struct dnn_train *train)
 {
 	int i;
 
-	free(train->d_lays[0].act);
-	free(train->d_lays[0].d_act);
+	train_free_bufs(train);
 	for(i = 1; i < train->net->num_lays; ++i){
 		free(train->d_lays[i].d_bias);
-		free(train->d_lays[i].wtd_sum);
-		free(train->d_lays[i].d_wtd_sum);
-		free(train->d_lays[i].act);
-		free(train->d_lays[i].d_act);
-		free(train->d_lays[i].d_wm);
-		free(train->d_lays[i].d_wm_alloc_handle);
+		free(train->d_lays[i].d_aptx);
+		free(train->d_lays[i].d_lr_u);
+		free(train->d_lays[i].d_lr_v);
+		free(train->d_lays[i].lr_t);
+		free(train->d_lays[i].d_lr_t);
 	}
 
 	free(train->d_lays);
@@ -244,6 +560,35 @@ float *xavier_data(int n_cols, int n_rows)
 	return data;
 }
 
+/* factored layers get each factor initialized like a layer of its own */
+static int init_lowrank(struct dnn_net *net, int lay)
+{
+	int j;
+	int n_in, n_out, rank;
+	float *xavier_wts;
+
+	n_in = net->lay_sizes[lay];
+	n_out = net->lay_sizes[lay + 1];
+	rank = net->lays[lay].rank;
+
+	xavier_wts = xavier_data(n_in, rank);
+	if(!xavier_wts)
+		return -1;
+	memcpy(net->lays[lay].lr_v, xavier_wts, sizeof *xavier_wts * rank * n_in);
+	free(xavier_wts);
+
+	xavier_wts = xavier_data(rank, n_out);
+	if(!xavier_wts)
+		return -1;
+	memcpy(net->lays[lay].lr_u, xavier_wts, sizeof *xavier_wts * n_out * rank);
+	free(xavier_wts);
+
+	for(j = 0; j < n_out; ++j)
+		net->lays[lay].bias[j] = 0;
+
+	return 0;
+}
+
 /* "Xavier initialization" heuristic, originally called normalized initialization [https://proceedings.mlr.press/v9/glorot10a/glorot10a.pdf]*/
 int dnn_init_net(struct dnn_net *net)
 {
@@ -254,6 +599,11 @@ int dnn_init_net(struct dnn_net *net)
 		return -1;
 
 	for(i = 0; i < net->num_lays - 1; ++i){
+		if(net->lays[i].rank){
+			if(init_lowrank(net, i))
+				return -1;
+			continue;
+		}
 		xavier_wts = xavier_data(net->lay_sizes[i], net->lay_sizes[i + 1]);
 		if(!xavier_wts)
 			return -1;
@@ -265,17 +615,55 @@ int dnn_init_net(struct dnn_net *net)
 				net->lays[i].wm[j][k] = xavier_wts[j * net->lay_sizes[i] + k];
 		}
 		free(xavier_wts);
+		dnn_pack_layer(net, i);
 	}
 
 	return 0;
 }
 
+/* float arrays go to and from save files as raw bytes in one call each,
+ * which is most of the file */
+static void save_floats(FILE *fp, const float *buf, long n)
+{
+	if(n > 0)
+		fwrite(buf, sizeof *buf, n, fp);
+}
+
+static int load_floats(FILE *fp, float *buf, long n)
+{
+	if(n > 0 && fread(buf, sizeof *buf, n, fp) != (size_t)n)
+		return -1;
+	return 0;
+}
+
+/* little endian int, sets *err if the file runs out */
+static int load_int(FILE *fp, int *err)
+{
+	int i, c;
+	int x;
+
+	x = 0;
+	for(i = 0; i < (int)sizeof x; ++i){
+		c = fgetc(fp);
+		if(c == EOF)
+			*err = 1;
+		x |= (c & 0xff) << 8 * i;
+	}
+
+	return x;
+}
+
 int dnn_save_net(struct dnn_net *net, const char *filename)
 {
 	int i, j;
 	FILE *fp;
-	char *data_access;
-	static float float_magicnum = 9;
+	/* 9: original format
+	 * 10: an int output mode follows the layer sizes
+	 * 11: each layer's weights are followed by an int count of APTx
+	 *     parameter sets and 3 * count floats of them
+	 * 12: an int rank precedes each layer's weights, if nonzero they are
+	 *     stored as the factors lr_u then lr_v */
+	static float float_magicnum = 12;
 
 	fp = fopen(filename, "w");
 	if(!fp)
@@ -283,8 +671,7 @@ int dnn_save_net(struct dnn_net *net, const char *filename)
 
 	/* float_magicnum, validates savefile compatibility
 	 * plus can encode shit in it too version information etc */
-	for(i = 0; i < (int)sizeof float_magicnum; ++i)
-		fputc(((char *)&float_magicnum)[i], fp);
+	save_floats(fp, &float_magicnum, 1);
 
 	/* number of layers */
 	for(i = 0; i < (int)sizeof net->num_lays; ++i)
@@ -295,31 +682,52 @@ int dnn_save_net(struct dnn_net *net, const char *filename)
 		for(j = 0; j < (int)sizeof *net->lay_sizes; ++j)
 			fputc((char)(net->lay_sizes[i] >> (8 * j)), fp);
 
+	/* output layer mode */
+	for(i = 0; i < (int)sizeof net->out_mode; ++i)
+		fputc((char)(net->out_mode >> (8 * i)), fp);
+
 	/* write parameters, enough informantion to decode and load this
 	 * data is now stored in the header bytes */
 	for(i = 0; i < net->num_lays - 1; ++i){
-		data_access = (char *)net->lays[i].bias;
-		for(j = 0; j < net->lay_sizes[i + 1] * (int)sizeof *net->lays[i].bias; ++j)
-			fputc(data_access[j], fp);
+		save_floats(fp, net->lays[i].bias, net->lay_sizes[i + 1]);
+
+		for(j = 0; j < (int)sizeof net->lays[i].rank; ++j)
+			fputc((char)(net->lays[i].rank >> (8 * j)), fp);
+		if(net->lays[i].rank){
+			save_floats(fp, net->lays[i].lr_u,
+					(long)net->lay_sizes[i + 1] * net->lays[i].rank);
+			save_floats(fp, net->lays[i].lr_v,
+					(long)net->lays[i].rank * net->lay_sizes[i]);
+		}else{
+			save_floats(fp, net->lays[i].wm_alloc_handle,
+					(long)net->lay_sizes[i] * net->lay_sizes[i + 1]);
+		}
 
-		data_access = (char *)net->lays[i].wm_alloc_handle;
-		for(j = 0; j < net->lay_sizes[i] * net->lay_sizes[i + 1] * (int)sizeof *net->lays[i].wm_alloc_handle; ++j)
-			fputc(data_access[j], fp);
+		for(j = 0; j < (int)sizeof net->lays[i].n_aptx; ++j)
+			fputc((char)(net->lays[i].n_aptx >> (8 * j)), fp);
+		save_floats(fp, net->lays[i].aptx, 3L * net->lays[i].n_aptx);
 	}
 
 	fputc(EOF, fp);
-	fclose(fp);
+	if(ferror(fp)){
+		fclose(fp);
+		return -1;
+	}
+	if(fclose(fp))
+		return -1;
 
 	return 0;
 }
 
 struct dnn_net *dnn_load_net(const char *filename)
 {
-	int i, j;
+	int i;
+	int err;
 	int num_lays;
+	int n_aptx;
+	int rank;
 	float float_magicnum;
 	int *lay_sizes;
-	char *data_access;
 	struct dnn_net *net;
 	FILE *fp;
 
@@ -327,74 +735,381 @@ struct dnn_net *dnn_load_net(const char *filename)
 	if(!fp)
 		return NULL;
 
+	net = NULL;
+	lay_sizes = NULL;
+	err = 0;
+
 	/* validate save file compatibility */
-	for(i = 0; i < (int)sizeof float_magicnum; ++i)
-		((char *)&float_magicnum)[i] = fgetc(fp);
-	if(float_magicnum != 9)
-		return NULL;
+	if(load_floats(fp, &float_magicnum, 1))
+		goto fail;
+	if(float_magicnum != 9 && float_magicnum != 10 && float_magicnum != 11 &&
+			float_magicnum != 12)
+		goto fail;
 
-	num_lays = 0;
-	for(i = 0; i < (int)sizeof num_lays; ++i)
-		num_lays |= fgetc(fp) << 8 * i;
+	num_lays = load_int(fp, &err);
+	if(err || num_lays < 2)
+		goto fail;
 
 	lay_sizes = malloc(sizeof *lay_sizes * num_lays);
+	if(!lay_sizes)
+		goto fail;
 	for(i = 0; i < num_lays; ++i){
-		lay_sizes[i] = 0;
-		for(j = 0; j < (int)sizeof *lay_sizes; ++j)
-			lay_sizes[i] |= fgetc(fp) << 8 * j;
+		lay_sizes[i] = load_int(fp, &err);
+		if(err || lay_sizes[i] < 1)
+			goto fail;
 	}
 
 	net = dnn_create_network(num_lays, lay_sizes);
+	if(!net)
+		goto fail;
+
+	if(float_magicnum >= 10){
+		net->out_mode = load_int(fp, &err);
+		if(err || (net->out_mode != DNN_OUT_ACT &&
+				net->out_mode != DNN_OUT_SOFTMAX))
+			goto fail;
+	}
 
 	for(i = 0; i < num_lays - 1; ++i){
-		data_access = (char *)net->lays[i].bias;
-		for(j = 0; j < lay_sizes[i + 1] * (int)sizeof float_magicnum; ++j)
-			data_access[j] = fgetc(fp);
+		if(load_floats(fp, net->lays[i].bias, lay_sizes[i + 1]))
+			goto fail;
+
+		rank = 0;
+		if(float_magicnum >= 12)
+			rank = load_int(fp, &err);
+		if(rank){
+			if(rank < 0 || rank > lay_sizes[i] || rank > lay_sizes[i + 1] ||
+					dnn_lowrank_alloc(net, i, rank))
+				goto fail;
+			if(load_floats(fp, net->lays[i].lr_u, (long)lay_sizes[i + 1] * rank) ||
+					load_floats(fp, net->lays[i].lr_v, (long)rank * lay_sizes[i]))
+				goto fail;
+		}else if(load_floats(fp, net->lays[i].wm_alloc_handle,
+					(long)lay_sizes[i] * lay_sizes[i + 1])){
+			goto fail;
+		}
 
-		data_access = (char *)net->lays[i].wm_alloc_handle;
-		for(j = 0; j < lay_sizes[i] * lay_sizes[i + 1] * (int)sizeof float_magicnum; ++j)
-			data_access[j] = fgetc(fp);
+		if(float_magicnum < 11)
+			continue;
+		n_aptx = load_int(fp, &err);
+		if(err)
+			goto fail;
+		if(!n_aptx)
+			continue;
+		if(dnn_set_act_aptx(net, i + 1, n_aptx > 1) || net->lays[i].n_aptx != n_aptx)
+			goto fail;
+		if(load_floats(fp, net->lays[i].aptx, 3L * n_aptx))
+			goto fail;
 	}
+	if(err)
+		goto fail;
 
 	free(lay_sizes);
 	fclose(fp);
 
+	/* pick up this host's kernel choices if it has been tuned */
+	dnn_apply_tuning(net);
+
 	return net;
+
+fail:
+	if(net)
+		dnn_destroy_net(net);
+	free(lay_sizes);
+	fclose(fp);
+
+	return NULL;
+}
+
+/* sizes each layer's APTx parameter gradients to match the net, which may
+ * have had trainable activations set since train was created */
+static int train_alloc_aptx(struct dnn_train *train)
+{
+	int i;
+	int n;
+	struct dnn_d_layer *d_lay;
+
+	for(i = 1; i < train->net->num_lays; ++i){
+		d_lay = &train->d_lays[i];
+		n = train->net->lays[i - 1].n_aptx;
+		if(d_lay->n_d_aptx == n)
+			continue;
+		free(d_lay->d_aptx);
+		d_lay->d_aptx = NULL;
+		d_lay->n_d_aptx = 0;
+		if(!n)
+			continue;
+		d_lay->d_aptx = calloc(3 * n, sizeof *d_lay->d_aptx);
+		if(!d_lay->d_aptx)
+			return -1;
+		d_lay->n_d_aptx = n;
+	}
+
+	return 0;
+}
+
+/* sizes the factor gradients of train's low rank layers to match the net,
+ * which may have been compressed since train was created */
+static int train_alloc_lowrank(struct dnn_train *train)
+{
+	int i;
+	int r, n_in, n_out;
+	struct dnn_d_layer *d_lay;
+
+	for(i = 1; i < train->net->num_lays; ++i){
+		d_lay = &train->d_lays[i];
+		r = train->net->lays[i - 1].rank;
+		if(d_lay->n_d_rank == r)
+			continue;
+		free(d_lay->d_lr_u);
+		free(d_lay->d_lr_v);
+		free(d_lay->lr_t);
+		free(d_lay->d_lr_t);
+		d_lay->d_lr_u = d_lay->d_lr_v = d_lay->lr_t = d_lay->d_lr_t = NULL;
+		d_lay->n_d_rank = 0;
+		if(!r)
+			continue;
+		n_in = train->net->lay_sizes[i - 1];
+		n_out = train->net->lay_sizes[i];
+		d_lay->d_lr_u = malloc(sizeof *d_lay->d_lr_u * n_out * r);
+		d_lay->d_lr_v = malloc(sizeof *d_lay->d_lr_v * r * n_in);
+		d_lay->lr_t = malloc(sizeof *d_lay->lr_t * r);
+		d_lay->d_lr_t = malloc(sizeof *d_lay->d_lr_t * r);
+		if(!d_lay->d_lr_u || !d_lay->d_lr_v || !d_lay->lr_t || !d_lay->d_lr_t)
+			return -1;
+		d_lay->n_d_rank = r;
+	}
+
+	return 0;
+}
+
+/* the weight gradients and d_act of the layer below for factored layer
+ * i of train, from its d_wtd_sum and the rank intermediate saved by the
+ * forward pass */
+static void train_backward_lowrank(struct dnn_train *train, int i)
+{
+	int j, k, c;
+	int r, n_in, n_out;
+	float d;
+	const float *u, *v;
+	struct dnn_d_layer *d_lay, *d_prev;
+
+	d_lay = &train->d_lays[i];
+	d_prev = &train->d_lays[i - 1];
+	r = train->net->lays[i - 1].rank;
+	u = train->net->lays[i - 1].lr_u;
+	v = train->net->lays[i - 1].lr_v;
+	n_in = train->net->lay_sizes[i - 1];
+	n_out = train->net->lay_sizes[i];
+
+	/* through lr_u */
+	memset(d_lay->d_lr_t, 0, sizeof *d_lay->d_lr_t * r);
+	for(j = 0; j < n_out; ++j){
+		d = d_lay->d_wtd_sum[j];
+		for(c = 0; c < r; ++c){
+			d_lay->d_lr_u[j * r + c] = d * d_lay->lr_t[c];
+			d_lay->d_lr_t[c] += d * u[j * r + c];
+		}
+	}
+
+	/* through lr_v */
+	memset(d_prev->d_act, 0, sizeof *d_prev->d_act * n_in);
+	for(c = 0; c < r; ++c){
+		d = d_lay->d_lr_t[c];
+		for(k = 0; k < n_in; ++k){
+			d_lay->d_lr_v[c * n_in + k] = d * d_prev->act[k];
+			d_prev->d_act[k] += d * v[c * n_in + k];
+		}
+	}
+}
+
+/* dnn_train() in DNN_PREC_BF16, activations and gradients are stored as
+ * bf16 but every sum is accumulated in fp32, the output gradient is
+ * multiplied by loss_scale which dnn_apply() divides back out */
+static int dnn_train_bf16(float *inp, float *want, struct dnn_train *train)
+{
+	int i, j, k;
+	int n_in, n_out;
+	int n_aptx;
+	int softmax;
+	float sum, z, d, max;
+	float *wt;
+	struct dnn_d_layer *d_lay, *d_prev;
+	struct dnn_net *net;
+
+	net = train->net;
+	softmax = net->out_mode == DNN_OUT_SOFTMAX;
+	/* factored layers only train in fp32 */
+	if(dnn_net_has_lowrank(net))
+		return -1;
+	if(train_alloc_aptx(train))
+		return -1;
+
+	for(i = 0; i < net->lay_sizes[0]; ++i)
+		train->d_lays[0].bf_act[i] = dnn_f32_to_bf16(inp[i]);
+
+	for(i = 1; i < net->num_lays; ++i){
+		d_lay = &train->d_lays[i];
+		d_prev = &train->d_lays[i - 1];
+		n_in = net->lay_sizes[i - 1];
+		for(j = 0; j < net->lay_sizes[i]; ++j){
+			sum = 0;
+			for(k = 0; k < n_in; ++k)
+				sum += net->lays[i - 1].wm[j][k] * dnn_bf16_to_f32(d_prev->bf_act[k]);
+			sum += net->lays[i - 1].bias[j];
+			d_lay->bf_wtd_sum[j] = dnn_f32_to_bf16(sum);
+			if(softmax && i == net->num_lays - 1)
+				continue;
+			if(net->lays[i - 1].n_aptx)
+				d_lay->bf_act[j] = dnn_f32_to_bf16(dnn_aptx(net->lays[i - 1].aptx,
+							net->lays[i - 1].n_aptx, j, sum));
+			else
+				d_lay->bf_act[j] = dnn_f32_to_bf16(net->lays[i - 1].actv_func(sum));
+		}
+	}
+
+	d_lay = &train->d_lays[net->num_lays - 1];
+	n_out = net->lay_sizes[net->num_lays - 1];
+	if(softmax){
+		/* stable softmax straight from the stored logits, then the fused
+		 * cross entropy gradient p - y */
+		max = dnn_bf16_to_f32(d_lay->bf_wtd_sum[0]);
+		for(i = 1; i < n_out; ++i){
+			z = dnn_bf16_to_f32(d_lay->bf_wtd_sum[i]);
+			max = z > max ? z : max;
+		}
+		sum = 0;
+		for(i = 0; i < n_out; ++i)
+			sum += expf(dnn_bf16_to_f32(d_lay->bf_wtd_sum[i]) - max);
+		for(i = 0; i < n_out; ++i){
+			d = expf(dnn_bf16_to_f32(d_lay->bf_wtd_sum[i]) - max) / sum;
+			d_lay->bf_act[i] = dnn_f32_to_bf16(d);
+			d_lay->bf_d_act[i] = d_lay->bf_d_wtd_sum[i] =
+				dnn_f32_to_bf16(train->loss_scale * (d - want[i]));
+		}
+	}else{
+		for(i = 0; i < n_out; ++i)
+			d_lay->bf_d_act[i] = dnn_f32_to_bf16(train->loss_scale *
+					train->d_cost(dnn_bf16_to_f32(d_lay->bf_act[i]), want[i]));
+	}
+
+	for(i = net->num_lays - 1; i > 0; --i){
+		d_lay = &train->d_lays[i];
+		d_prev = &train->d_lays[i - 1];
+		n_in = net->lay_sizes[i - 1];
+		n_out = net->lay_sizes[i];
+		n_aptx = net->lays[i - 1].n_aptx;
+		if(n_aptx)
+			memset(d_lay->d_aptx, 0, sizeof *d_lay->d_aptx * 3 * n_aptx);
+		for(j = 0; j < n_out; ++j){
+			if(softmax && i == net->num_lays - 1){
+				d_lay->d_bias[j] = dnn_bf16_to_f32(d_lay->bf_d_wtd_sum[j]);
+				continue;
+			}
+			z = dnn_bf16_to_f32(d_lay->bf_wtd_sum[j]);
+			if(n_aptx)
+				d = dnn_aptx_backward(net->lays[i - 1].aptx, d_lay->d_aptx, n_aptx, j,
+						z, dnn_bf16_to_f32(d_lay->bf_d_act[j]));
+			else
+				d = d_lay->d_actv_func(z) * dnn_bf16_to_f32(d_lay->bf_d_act[j]);
+			d_lay->bf_d_wtd_sum[j] = dnn_f32_to_bf16(d);
+			d_lay->d_bias[j] = d;
+		}
+		for(j = 0; j < n_out; ++j){
+			d = dnn_bf16_to_f32(d_lay->bf_d_wtd_sum[j]);
+			for(k = 0; k < n_in; ++k)
+				d_lay->bf_d_wm[j * n_in + k] = dnn_f32_to_bf16(d *
+						dnn_bf16_to_f32(d_prev->bf_act[k]));
+		}
+		if(train->dist)
+			dnn_dist_layer_done(train->dist, i);
+		for(k = 0; k < n_in; ++k){
+			wt = &net->lays[i - 1].wm_t[k * n_out];
+			sum = 0;
+			for(j = 0; j < n_out; ++j)
+				sum += dnn_bf16_to_f32(d_lay->bf_d_wtd_sum[j]) * wt[j];
+			d_prev->bf_d_act[k] = dnn_f32_to_bf16(sum);
+		}
+	}
+
+	return 0;
 }
 
 int dnn_train(float *inp, float *want, struct dnn_train *train)
 {
 	int i, j, k;
+	float *wt;
+	struct dnn_layer *lay;
+	struct dnn_d_layer *out;
+
+	if(train->precision == DNN_PREC_BF16)
+		return dnn_train_bf16(inp, want, train);
+	if(train_alloc_aptx(train) || train_alloc_lowrank(train))
+		return -1;
 
 	for(i = 0; i < train->net->lay_sizes[0]; ++i)
 		train->d_lays[0].act[i] = inp[i];
 
 	/* forward pass, saving useful parameters */
 	for(i = 1; i < train->net->num_lays; ++i){
-		for(j = 0; j < train->net->lay_sizes[i]; ++j){
-			train->d_lays[i].wtd_sum[j] = 0;
-			for(k = 0; k < train->net->lay_sizes[i - 1]; ++k)
-				train->d_lays[i].wtd_sum[j] +=
-					train->net->lays[i - 1].wm[j][k] *
-					train->d_lays[i - 1].act[k];
+		if(train->net->lays[i - 1].rank)
+			dnn_lowrank_matvec(train->net, i - 1, 0, train->net->lay_sizes[i],
+					train->d_lays[i - 1].act, train->d_lays[i].lr_t,
+					train->d_lays[i].wtd_sum);
+		else
+			dnn_lay_matvec(train->net, i - 1, 0, train->net->lay_sizes[i],
+					train->d_lays[i - 1].act, train->d_lays[i].wtd_sum);
+		for(j = 0; j < train->net->lay_sizes[i]; ++j)
 			train->d_lays[i].wtd_sum[j] += train->net->lays[i - 1].bias[j];
-			train->d_lays[i].act[j] = train->net->lays[i - 1].actv_func(train->d_lays[i].wtd_sum[j]);
-		}
+		dnn_activate(train->net, i - 1, train->d_lays[i].wtd_sum, train->d_lays[i].act);
+	}
+	out = &train->d_lays[train->net->num_lays - 1];
+	if(train->net->out_mode == DNN_OUT_SOFTMAX){
+		/* softmax + cross entropy, d(cost)/d(wtd_sum) is just p - y so
+		 * skip the chain rule through d_cost and d_actv_func */
+		for(i = 0; i < train->net->lay_sizes[train->net->num_lays - 1]; ++i)
+			out->d_wtd_sum[i] = out->d_act[i] = out->act[i] - want[i];
+	}else{
+		for(i = 0; i < train->net->lay_sizes[train->net->num_lays - 1]; ++i)
+			out->d_act[i] = train->d_cost(out->act[i], want[i]);
 	}
-	for(i = 0; i < train->net->lay_sizes[train->net->num_lays - 1]; ++i)
-		train->d_lays[train->net->num_lays - 1].d_act[i] = train->d_cost(train->d_lays[train->net->num_lays - 1].act[i], want[i]);
 	/* backpropegationnnnnnnnn baby */
 	for(i = train->net->num_lays - 1; i > 0; --i){
-		for(j = 0; j < train->net->lay_sizes[i]; ++j){
-			train->d_lays[i].d_wtd_sum[j] = train->d_lays[i].d_actv_func(train->d_lays[i].wtd_sum[j]) * train->d_lays[i].d_act[j];
+		lay = &train->net->lays[i - 1];
+		if(&train->d_lays[i] == out && train->net->out_mode == DNN_OUT_SOFTMAX){
+			/* d_wtd_sum already set */
+		}else if(lay->n_aptx){
+			/* the activation's own parameters get gradients too */
+			memset(train->d_lays[i].d_aptx, 0, sizeof *train->d_lays[i].d_aptx * 3 * lay->n_aptx);
+			for(j = 0; j < train->net->lay_sizes[i]; ++j)
+				train->d_lays[i].d_wtd_sum[j] = dnn_aptx_backward(lay->aptx,
+						train->d_lays[i].d_aptx, lay->n_aptx, j,
+						train->d_lays[i].wtd_sum[j], train->d_lays[i].d_act[j]);
+		}else{
+			for(j = 0; j < train->net->lay_sizes[i]; ++j)
+				train->d_lays[i].d_wtd_sum[j] = train->d_lays[i].d_actv_func(train->d_lays[i].wtd_sum[j]) * train->d_lays[i].d_act[j];
+		}
+		for(j = 0; j < train->net->lay_sizes[i]; ++j)
 			train->d_lays[i].d_bias[j] = train->d_lays[i].d_wtd_sum[j];
+		if(lay->rank){
+			train_backward_lowrank(train, i);
+			continue;
 		}
 		for(j = 0; j < train->net->lay_sizes[i]; ++j)
 			for(k = 0; k < train->net->lay_sizes[i - 1]; ++k)
 				train->d_lays[i].d_wm[j][k] = train->d_lays[i].d_wtd_sum[j] * train->d_lays[i - 1].act[k];
-		for(k = 0; k < train->net->lay_sizes[i - 1]; ++k)
+		/* this layer's gradients are final, let the other ranks have
+		 * them while we carry on down the network */
+		if(train->dist)
+			dnn_dist_layer_done(train->dist, i);
+		/* every node of layer i contributes to d_act[k], walk the
+		 * transposed weights so column k of wm is contiguous */
+		for(k = 0; k < train->net->lay_sizes[i - 1]; ++k){
+			wt = &train->net->lays[i - 1].wm_t[k * train->net->lay_sizes[i]];
+			train->d_lays[i - 1].d_act[k] = 0;
 			for(j = 0; j < train->net->lay_sizes[i]; ++j)
-				train->d_lays[i - 1].d_act[k] = train->d_lays[i].d_wtd_sum[j] * train->net->lays[i - 1].wm[j][k];
+				train->d_lays[i - 1].d_act[k] += train->d_lays[i].d_wtd_sum[j] * wt[j];
+		}
 	}
 	return 0;
 }
@@ -405,36 +1120,105 @@ float *get_input_gradient(struct dnn_train *train)
 	float *inp_grad;
 
 	inp_grad = malloc(sizeof *inp_grad * train->net->lay_sizes[0]);
+	if(train->precision == DNN_PREC_BF16){
+		for(i = 0; i < train->net->lay_sizes[0]; ++i)
+			inp_grad[i] = dnn_bf16_to_f32(train->d_lays[0].bf_d_act[i]) / train->loss_scale;
+		return inp_grad;
+	}
 	for(i = 0; i < train->net->lay_sizes[0]; ++i)
 		inp_grad[i] = train->d_lays[0].d_act[i];
 
 	return inp_grad;
 }
 
+/* dnn_apply()'s update of factored layer i of train's net, scale being
+ * the step multiplying the gradients */
+static void apply_lowrank(struct dnn_train *train, int i, float scale)
+{
+	int j;
+	int r, n_in, n_out;
+	struct dnn_layer *lay;
+	struct dnn_d_layer *d_lay;
+
+	lay = &train->net->lays[i - 1];
+	d_lay = &train->d_lays[i];
+	r = lay->rank;
+	/* no gradients yet for this shape */
+	if(d_lay->n_d_rank != r)
+		return;
+	n_in = train->net->lay_sizes[i - 1];
+	n_out = train->net->lay_sizes[i];
+
+	for(j = 0; j < n_out * r; ++j)
+		lay->lr_u[j] += scale * d_lay->d_lr_u[j];
+	for(j = 0; j < r * n_in; ++j)
+		lay->lr_v[j] += scale * d_lay->d_lr_v[j];
+	for(j = 0; j < n_out; ++j)
+		lay->bias[j] += scale * d_lay->d_bias[j];
+	for(j = 0; j < 3 * d_lay->n_d_aptx; ++j)
+		lay->aptx[j] += scale * d_lay->d_aptx[j];
+}
+
 int dnn_apply(struct dnn_train **train, int n_train, float train_aggr)
 {
 	int i, j, k, l;
+	int n_in;
+	float scale;
+	uint16_t *bf_d_wm;
 
 	for(i = 0; i < n_train; ++i){
+		if(train[i]->precision == DNN_PREC_BF16){
+			/* fp32 master weights, the bf16 gradient is widened and
+			 * unscaled as it is accumulated */
+			scale = -1 * train_aggr / (float)n_train / train[i]->loss_scale;
+			for(j = 1; j < train[i]->net->num_lays; ++j){
+				/* bf16 never trains a factored layer, anything in its
+				 * gradients is left over from fp32 */
+				if(train[i]->net->lays[j - 1].rank)
+					continue;
+				n_in = train[i]->net->lay_sizes[j - 1];
+				bf_d_wm = train[i]->d_lays[j].bf_d_wm;
+				for(k = 0; k < train[i]->net->lay_sizes[j]; ++k){
+					for(l = 0; l < n_in; ++l)
+						train[i]->net->lays[j - 1].wm[k][l] += scale * dnn_bf16_to_f32(bf_d_wm[k * n_in + l]);
+					train[i]->net->lays[j - 1].bias[k] += scale * train[i]->d_lays[j].d_bias[k];
+				}
+				for(k = 0; k < 3 * train[i]->d_lays[j].n_d_aptx; ++k)
+					train[i]->net->lays[j - 1].aptx[k] += scale * train[i]->d_lays[j].d_aptx[k];
+			}
+			continue;
+		}
 		for(j = 1; j < train[i]->net->num_lays; ++j){
+			if(train[i]->net->lays[j - 1].rank){
+				apply_lowrank(train[i], j, -1 * train_aggr / (float)n_train);
+				continue;
+			}
 			for(k = 0; k < train[i]->net->lay_sizes[j]; ++k){
 				for(l = 0; l < train[i]->net->lay_sizes[j - 1]; ++l)
 					train[i]->net->lays[j - 1].wm[k][l] += -1 * train_aggr / (float)n_train * train[i]->d_lays[j].d_wm[k][l];
 				train[i]->net->lays[j - 1].bias[k] += -1 * train_aggr / (float)n_train * train[i]->d_lays[j].d_bias[k];
 			}
+			for(k = 0; k < 3 * train[i]->d_lays[j].n_d_aptx; ++k)
+				train[i]->net->lays[j - 1].aptx[k] += -1 * train_aggr / (float)n_train * train[i]->d_lays[j].d_aptx[k];
 		}
 	}
 
+	/* bring the backward pass's copy of the weights up to date */
+	for(i = 0; i < n_train; ++i)
+		if(i == 0 || train[i]->net != train[i - 1]->net)
+			dnn_repack_net(train[i]->net);
+
 	return 0;
 }
 
 float *dnn_test(struct dnn_net *net, float *inp)
 {
-	int i, j, k;
+	int i, j;
 	float *output;
 	float **act;
 	float *acts;
 	int sum_lay_sizes;
+	struct intra_group *intra;
 
 	if(!net || !inp)
 		return NULL;
@@ -461,16 +1245,16 @@ float *dnn_test(struct dnn_net *net, float *inp)
 	for(i = 0; i < net->lay_sizes[0]; ++i)
 		act[0][i] = inp[i];
 
-	/* its alive! */
+	/* its alive! wide layers are split over the intra-op group, if
+	 * there is one and no other pass is using it */
+	intra = dnn_intra_get();
 	for(i = 0; i < net->num_lays - 1; ++i){
-		for(j = 0; j < net->lay_sizes[i + 1]; ++j){
-			act[i + 1][j] = 0;
-			for(k = 0; k < net->lay_sizes[i]; ++k)
-				act[i + 1][j] += net->lays[i].wm[j][k] * act[i][k];
-			act[i + 1][j] = net->lays[i].actv_func(act[i + 1][j] +
-					net->lays[i].bias[j]);
-		}
+		dnn_intra_matvec(intra, net, i, act[i], act[i + 1]);
+		for(j = 0; j < net->lay_sizes[i + 1]; ++j)
+			act[i + 1][j] += net->lays[i].bias[j];
+		dnn_activate(net, i, act[i + 1], act[i + 1]);
 	}
+	dnn_intra_put(intra);
 
 	for(i = 0; i < net->lay_sizes[net->num_lays - 1]; ++i)
 		output[i] = act[net->num_lays - 1][i];
@@ -44,6 +44,67 @@ extern "C"
  *
  */
 
+	/* constants */
+
+/* training precisions, see dnn_set_train_precision() */
+#define DNN_PREC_FP32	0
+#define DNN_PREC_BF16	1
+
+/* losses reported by dnn_evaluate() */
+#define DNN_METRIC_MSE	0	/* sum of squared errors against a one-hot target */
+#define DNN_METRIC_XENT	1	/* -log(output[label]) */
+
+/* output layer modes, see dnn_set_output() */
+#define DNN_OUT_ACT	0
+#define DNN_OUT_SOFTMAX	1
+
+/* buffer placement flags, see dnn_set_placement() */
+#define DNN_PLACE_HUGEPAGES	1
+#define DNN_PLACE_HUGETLB	2
+#define DNN_PLACE_INTERLEAVE	4
+#define DNN_PLACE_PIN_THREADS	8
+
+/* largest rank of a factored layer, see dnn_compress_lowrank() */
+#define DNN_MAX_RANK	1024
+
+	/* result types */
+
+struct dnn_eval{
+	int n;			/* examples evaluated */
+	int n_classes;		/* == size of the output layer */
+	int n_correct;		/* examples whose largest output was their label */
+	float accuracy;		/* n_correct / n */
+	float mean_loss;	/* per example, as chosen by the metric */
+	int *confusion;		/* n_classes * n_classes counts, indexed
+				 * [label * n_classes + guess] */
+};
+
+	/* memory placement */
+
+int dnn_set_placement(int flags);
+/* dnn_set_placement() sets how the weight and gradient buffers of networks
+ * and training objects created afterwards are placed in memory, flags is 0
+ * (default, plain malloc) or any of:
+ * DNN_PLACE_HUGEPAGES	back them with transparent huge pages
+ * DNN_PLACE_HUGETLB	back them with explicitly reserved huge pages,
+ *			or transparent ones if none are reserved
+ * DNN_PLACE_INTERLEAVE	spread their pages over every numa node, so no
+ *			socket's threads all read across the interconnect
+ * DNN_PLACE_PIN_THREADS	pin the library's worker threads to one cpu each
+ * whatever the host doesn't support falls back to plain allocation
+ * process wide, not thread safe, call before creating networks */
+
+	/* intra-op parallelism */
+
+int dnn_set_intra_threads(int threads);
+/* dnn_set_intra_threads() gives dnn_test() a group of threads (counting
+ * the one calling dnn_test()) to split the rows of each wide layer over,
+ * cutting the latency of a single forward pass, 0 or 1 removes the group
+ * one pass uses the group at a time, concurrent ones run single threaded
+ * idle workers spin briefly after each pass before going to sleep, and
+ * are pinned as the library's other workers are
+ * process wide, not thread safe, call while no dnn_test() is running */
+
 	/* dnn_type creation */
 
 struct dnn_net *dnn_create_network(int num_lays, int *lay_sizes);
@@ -53,16 +114,29 @@ struct dnn_net *dnn_create_network(int num_lays, int *lay_sizes);
 struct dnn_train *dnn_create_train(struct dnn_net *net);
 /* dnn_create_train() returns a training object handle which must be
  * passed to the training functions, and may only be used for training
- * the dnn_net for which it was created */
+ * the dnn_net for which it was created
+ * the first one on a net gives it a transposed copy of its weights, on
+ * failure net is left as it was */
 
 int dnn_init_net(struct dnn_net *net);
 /* dnn_init_net() randomly initializes all weights and biases in the
  * network net using xavier initialization, all biases = 0 and all
  * weights normally distributed on the range [-1/sqrt(n), 1/sqrt(n)],
  * n == number of nodes in the weight's layer */
+int dnn_repack_net(struct dnn_net *net);
+/* training keeps a transposed copy of each layer's weights for the
+ * backward pass, which every library function that changes the weights
+ * keeps up to date, dnn_repack_net() must be called after changing them
+ * any other way (e.g. writing through danknn_intern.h) before training
+ * or dnn_inc_reset() */
 
 	/* set internal function pointers */
 
+float dnn_act_aptx(float x);
+float dnn_d_act_aptx(float x);
+/* the APTx activation with the paper's fixed alpha = 1, beta = 1,
+ * gamma = 1/2 and its derivative, for dnn_set_act_func() and
+ * dnn_set_d_act_func() */
 int dnn_set_act_func(struct dnn_net *net, int lay_num, 
 		float (*actv_func)(float x));
 /* dnn_set_act_func() sets the activation function of layer lay_num in network
@@ -71,6 +145,23 @@ int dnn_set_act_func(struct dnn_net *net, int lay_num,
  * function should be supplied and set with dnn_set_d_act_func() in order for
  * training results to be non-garbage 
  * swish is used by default if this is not called for each layer in a network */
+int dnn_set_act_aptx(struct dnn_net *net, int lay_num, int per_neuron);
+/* dnn_set_act_aptx() gives layer lay_num of net the APTx activation
+ * (alpha + tanh(beta * x)) * gamma * x with alpha, beta and gamma trained
+ * along with the weights, one set for the whole layer or one per neuron if
+ * per_neuron is nonzero, starting at alpha = 1, beta = 1, gamma = 1/2
+ * the layer's d_actv_func is ignored while this is set and the parameters
+ * are saved by dnn_save_net(), calling dnn_set_act_func() on the layer
+ * removes them */
+int dnn_set_output(struct dnn_net *net, int out_mode);
+/* dnn_set_output() chooses how net's output layer turns its weighted sums
+ * into outputs: DNN_OUT_ACT (default) applies the layer's activation
+ * function, DNN_OUT_SOFTMAX replaces it with a softmax over the layer
+ * with softmax outputs dnn_train() minimizes the cross entropy against
+ * want, which should then be a distribution (e.g. one-hot), computing the
+ * output gradient p - want in one pass and ignoring the train's d_cost and
+ * the output layer's d_actv_func
+ * the mode is saved by dnn_save_net() */
 int dnn_set_d_act_func(struct dnn_train *train, int lay_num,
 		float (*d_actv_func)(float x));
 /* dnn_set_d_act_func() sets the derivitave activation function for a layer in 
@@ -82,6 +173,32 @@ int dnn_set_d_cost_func(struct dnn_train *train,
  * training object, where d_cost_func defines the derivitave of cost for
  * a given out and want of a training example
  * defaults to d/dx(mean_squared_error(x)) */
+int dnn_set_train_precision(struct dnn_train *train, int precision,
+		float loss_scale);
+/* dnn_set_train_precision() switches train between DNN_PREC_FP32 (default)
+ * and DNN_PREC_BF16, in which the activations and gradients saved by
+ * dnn_train() are stored as bfloat16, about halving the training working
+ * set, while the network's weights stay fp32 and all sums are accumulated
+ * in fp32
+ * in bf16 the output gradient is multiplied by loss_scale to keep small
+ * gradients from flushing to zero, dnn_apply() divides it back out,
+ * 0 means no scaling, fp32 trains only accept 0 or 1
+ * switching precision discards train's current gradients */
+
+	/* low rank compression */
+
+int dnn_compress_lowrank(struct dnn_net *net, int lay_num, int rank, float energy);
+/* dnn_compress_lowrank() replaces the weights of layer lay_num of net with
+ * two thin factors of a truncated (randomized) svd, so the layer costs
+ * rank * (n_in + n_out) multiply-adds and floats instead of n_in * n_out
+ * the rank is rank if nonzero, else the smallest keeping the fraction
+ * energy (0 < energy <= 1) of the squared weights' sum, returns the rank
+ * used, or -1 with the layer unchanged if it wouldn't make it smaller or
+ * would need a rank above DNN_MAX_RANK
+ * factored layers work with dnn_test(), dnn_evaluate(), fp32 dnn_train()
+ * (which fine tunes the factors) and save/load, but not bf16 training,
+ * populations, dnn_create_incremental() on the first layer or data
+ * parallel training, and fails while net has a dnn_dist context */
 
 	/* network save/load */
 
@@ -93,6 +210,21 @@ struct dnn_net *dnn_load_net(const char *filename);
 /* dnn_net() returns an initialized network read from the parameters saved to
  * filename */
 
+	/* kernel autotuning */
+
+int dnn_autotune(struct dnn_net *net);
+/* dnn_autotune() benchmarks the library's dense layer kernels and blockings
+ * on every layer shape of net on this host, switches net to the fastest,
+ * and records them in the tuning cache, $DNN_TUNE_CACHE if set else
+ * ~/.cache/danknn.tune, keyed by cpu model and layer shape
+ * returns -1 if the cache couldn't be written, net is tuned regardless */
+int dnn_apply_tuning(struct dnn_net *net);
+/* dnn_apply_tuning() switches net to the kernels recorded in the tuning
+ * cache for this cpu and net's layer shapes, dnn_load_net() does this by
+ * itself, returns -1 if there is no cache
+ * the cache file is only read by the first call in a process, later ones
+ * see it as read then plus anything dnn_autotune() has recorded since */
+
 	/* network training and execution */
 
 int dnn_train(float *inp, float *want, struct dnn_train *train);
@@ -106,6 +238,14 @@ int dnn_apply(struct dnn_train **train, int n_train, float train_aggr);
 float *dnn_test(struct dnn_net *net, float *inp);
 /* dnn_test() returns an output float vector for the forward pass of input vector
  * inp through network net */
+struct dnn_eval *dnn_evaluate(struct dnn_net *net, float **inputs, int *labels,
+		int n, int metric, int threads);
+/* dnn_evaluate() runs the n input vectors inputs[n] through net as a
+ * classifier, splitting them across threads threads and batching the
+ * forward passes, and returns the accuracy, confusion matrix and mean loss
+ * of the outputs against the class indices labels[n]
+ * metric is DNN_METRIC_MSE or DNN_METRIC_XENT
+ * the result must be freed with dnn_destroy_eval() */
 float *get_input_gradient(struct dnn_train *train);
 /* returns the input gradient with repsect to cost from train,
  * useful for providing the negative of this to another network that
@@ -117,6 +257,195 @@ int dnn_destroy_net(struct dnn_net *net);
 /* frees memory owned by net, do not attempt to use net after calling this on it */
 int dnn_destroy_train(struct dnn_train *train);
 /* frees memory owned by train, ^^ */
+int dnn_destroy_eval(struct dnn_eval *eval);
+/* frees an evaluation result returned by dnn_evaluate() */
+
+	/* asynchronous inference */
+
+struct dnn_executor *dnn_create_executor(int threads, int max_batch);
+/* dnn_create_executor() starts threads worker threads that run submitted
+ * forward passes, batching up to max_batch queued requests for the same
+ * network into one pass */
+struct dnn_future *dnn_submit(struct dnn_executor *ex, struct dnn_net *net,
+		const float *inp);
+/* dnn_submit() queues the forward pass of input vector inp, which is
+ * copied, through net on ex and returns without waiting for it
+ * net must not be trained, freed or changed while it has requests queued
+ * the returned future must be passed to dnn_wait() exactly once */
+int dnn_poll(struct dnn_future *f);
+/* dnn_poll() returns 1 if f's forward pass is done, 0 if it is still
+ * queued or running, and -1 if it failed */
+int dnn_future_on_done(struct dnn_future *f, void (*cb)(void *arg), void *arg);
+/* dnn_future_on_done() has cb(arg) called once f completes, on the
+ * executor thread that completed it, so cb should be quick and must not
+ * dnn_wait() on a pending future or call dnn_destroy_executor()
+ * returns 0 if cb was registered, 1 if f had already completed, in which
+ * case cb is not called, one callback per future */
+float *dnn_wait(struct dnn_future *f);
+/* dnn_wait() blocks until f completes, frees f, and returns the output
+ * vector as dnn_test() would, to be freed by the caller, or NULL if the
+ * forward pass failed */
+int dnn_destroy_executor(struct dnn_executor *ex);
+/* dnn_destroy_executor() stops ex's threads, every future submitted to ex
+ * must have been passed to dnn_wait() first */
+
+	/* hot-swappable models */
+
+struct dnn_model_handle *dnn_create_model_handle(struct dnn_net *net, int max_readers);
+/* dnn_create_model_handle() returns a handle serving net, which it takes
+ * ownership of, to up to max_readers threads at once without locking
+ * further readers wait for one of them to release */
+struct dnn_net *dnn_model_acquire(struct dnn_model_handle *h);
+/* dnn_model_acquire() returns h's current network, which stays valid and
+ * unchanged, even across a swap, until passed to dnn_model_release()
+ * it may be used with dnn_test(), dnn_evaluate() and dnn_submit() but must
+ * not be trained or destroyed */
+int dnn_model_release(struct dnn_model_handle *h, struct dnn_net *net);
+/* dnn_model_release() hands back a network returned by dnn_model_acquire() */
+float *dnn_model_test(struct dnn_model_handle *h, float *inp);
+/* dnn_model_test() is dnn_test() on h's current network */
+int dnn_model_swap(struct dnn_model_handle *h, struct dnn_net *net);
+/* dnn_model_swap() makes net, which h takes ownership of, h's current
+ * network, readers acquiring after this get net, and the old network is
+ * destroyed once every reader holding it has released it, which this
+ * waits for, so the calling thread must not hold it itself */
+int dnn_model_reload(struct dnn_model_handle *h, const char *filename);
+/* dnn_model_reload() loads filename, as dnn_load_net(), and swaps it into
+ * h on a background thread, readers are not held up at any point
+ * returns -1 if a reload of h is already running */
+int dnn_model_reload_status(struct dnn_model_handle *h);
+/* dnn_model_reload_status() returns 1 while a reload of h is running, 0 if
+ * the last one succeeded (or none was started) and -1 if it failed, in
+ * which case h still serves the network it had */
+int dnn_destroy_model_handle(struct dnn_model_handle *h);
+/* dnn_destroy_model_handle() waits for any reload to finish and destroys
+ * h and its current network, no reader may still hold it */
+
+	/* model stores */
+
+struct dnn_model_store *dnn_create_model_store(const char *dir, long budget);
+/* dnn_create_model_store() returns a store of the networks saved, with
+ * dnn_save_net(), in the files of directory dir, none of which are loaded
+ * yet, files added to dir later are not seen
+ * the store keeps the networks it has loaded to about budget bytes of
+ * parameters, destroying the least recently used ones to make room */
+struct dnn_net *dnn_store_get(struct dnn_model_store *s, const char *name);
+/* dnn_store_get() returns the network saved in file name of s's directory,
+ * loading it if it isn't resident, for use with dnn_test(), dnn_evaluate()
+ * and dnn_submit() until it is passed to dnn_store_release()
+ * held networks are never evicted, so with more of them held than fit
+ * the budget the store goes over it until they are released
+ * thread safe, returns NULL if there is no such file or it won't load */
+int dnn_store_release(struct dnn_model_store *s, struct dnn_net *net);
+/* dnn_store_release() hands back one hold of a network from dnn_store_get() */
+float *dnn_store_test(struct dnn_model_store *s, const char *name, float *inp);
+/* dnn_store_test() is dnn_test() on network name of s */
+long dnn_store_resident(struct dnn_model_store *s);
+/* dnn_store_resident() returns the bytes of parameters s has loaded */
+int dnn_destroy_model_store(struct dnn_model_store *s);
+/* dnn_destroy_model_store() destroys s and every network it has loaded,
+ * none of which may still be held */
+
+	/* incremental evaluation */
+
+struct dnn_incremental *dnn_create_incremental(struct dnn_net *net, float *inp);
+/* dnn_create_incremental() returns a context holding input vector inp, of
+ * which it keeps a copy, and net's first layer weighted sums for it, for
+ * inputs that change only a few features between evaluations
+ * the first context on net gives its first layer the transposed copy
+ * dnn_repack_net() maintains, after that contexts only read net, so any
+ * number of them may share a net being served */
+float *dnn_inc_update(struct dnn_incremental *inc, int n, const int *idx,
+		const float *vals);
+/* dnn_inc_update() sets input idx[i] to vals[i] for each of the n changes
+ * and returns the new output of the net, the first layer costing one
+ * weight column per changed input instead of the whole matrix
+ * the returned vector belongs to inc and is overwritten by the next call */
+float *dnn_inc_reset(struct dnn_incremental *inc, float *inp);
+/* dnn_inc_reset() recomputes inc from scratch for input inp, or for its
+ * current input if inp is NULL, and returns the output like
+ * dnn_inc_update(), needed whenever net's parameters have changed (and
+ * dnn_repack_net() before it if they were changed by hand) */
+int dnn_destroy_incremental(struct dnn_incremental *inc);
+/* frees memory owned by inc, net is left alone */
+
+	/* populations of same-shape networks */
+
+struct dnn_population *dnn_create_population(struct dnn_net *net, int n_memb);
+/* dnn_create_population() returns a population of n_memb networks shaped
+ * like net, each starting as a copy of net's parameters and using its
+ * activation functions and output mode, stored interleaved so that
+ * training and testing all of them costs about as much as a few separate
+ * networks of the same shape
+ * nets with trainable activations (dnn_set_act_aptx()) are not supported */
+int dnn_init_population(struct dnn_population *pop);
+/* dnn_init_population() initializes every member of pop independently,
+ * as dnn_init_net() would */
+int dnn_pop_set_rate(struct dnn_population *pop, int memb, float rate);
+/* dnn_pop_set_rate() multiplies member memb's learning rate by rate,
+ * which defaults to 1 */
+int dnn_pop_set_d_act_func(struct dnn_population *pop, int lay_num,
+		float (*d_actv_func)(float x));
+int dnn_pop_set_d_cost_func(struct dnn_population *pop,
+		float (*d_cost_func)(float out, float want));
+/* the population's equivalents of dnn_set_d_act_func() and
+ * dnn_set_d_cost_func(), shared by all members */
+int dnn_pop_train(struct dnn_population *pop, float *inp, float *want);
+/* dnn_pop_train() runs the training example inp/want through every member
+ * of pop and adds their cost gradients to those accumulated since the last
+ * dnn_pop_apply(), like a dnn_train() on one more training object each */
+int dnn_pop_apply(struct dnn_population *pop, float train_aggr);
+/* dnn_pop_apply() updates each member by the average of its accumulated
+ * gradients times train_aggr times the member's rate, as dnn_apply() does,
+ * and clears them */
+float *dnn_pop_test(struct dnn_population *pop, float *inp);
+/* dnn_pop_test() returns the outputs of every member of pop for input
+ * vector inp, member m's starting at m * (output layer size)
+ * pop holds the activations, so only one thread may use it at a time */
+int dnn_pop_import(struct dnn_population *pop, int memb, struct dnn_net *net);
+/* dnn_pop_import() overwrites member memb's parameters with net's, net must
+ * have the population's layer sizes and, like the net a population is
+ * created from, no trainable activations or factored layers */
+struct dnn_net *dnn_pop_export(struct dnn_population *pop, int memb);
+/* dnn_pop_export() returns a new network holding a copy of member memb,
+ * to be used, saved and destroyed like any other */
+int dnn_destroy_population(struct dnn_population *pop);
+/* frees memory owned by pop */
+
+	/* multi-process data-parallel training */
+
+struct dnn_dist *dnn_dist_create(struct dnn_net *net, int rank, int world_size,
+		const char *next_host, int base_port);
+/* dnn_dist_create() joins net, this process's replica, to a ring of
+ * world_size training processes, rank being this process's position in it
+ * each rank listens on tcp port base_port + rank and connects to the next
+ * rank at next_host, port base_port + rank + 1 (wrapping to rank 0), so
+ * for a single machine pass "localhost" everywhere
+ * blocks until the ring is closed, a world_size of 1 needs no sockets
+ * net's trainable activations must be set before this is called */
+int dnn_dist_attach(struct dnn_dist *dist, struct dnn_train *train);
+/* dnn_dist_attach() adds train, created for dist's net, to the training
+ * objects whose gradients are reduced by dist every step
+ * once attached, each dnn_train() call on train hands each layer's gradient
+ * to dist as soon as it is computed, so communication overlaps with the
+ * rest of the backward pass
+ * ranks may attach different numbers of training objects, including none,
+ * a rank without any still has to call dnn_dist_apply() every step */
+int dnn_dist_bcast_net(struct dnn_dist *dist);
+/* dnn_dist_bcast_net() overwrites every rank's parameters with rank 0's,
+ * call once on every rank after initializing and before training */
+int dnn_dist_apply(struct dnn_dist *dist, float train_aggr);
+/* dnn_dist_apply() is dnn_apply() across all ranks: it waits for the
+ * gradients of every attached train on every rank to be summed, then
+ * updates the local replica by their average, leaving all replicas equal
+ * every attached train must have run dnn_train() exactly once since the
+ * last call, and every rank must call this each step */
+int dnn_dist_rank(struct dnn_dist *dist);
+int dnn_dist_world_size(struct dnn_dist *dist);
+/* return the values dist was created with */
+int dnn_dist_destroy(struct dnn_dist *dist);
+/* closes the ring and detaches all training objects, should be called
+ * between steps, after dnn_dist_apply() */
 
 #ifdef __cplusplus
 }
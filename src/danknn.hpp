@@ -0,0 +1,147 @@
+/* sam's Dank Neural Network library (libdanknn)
+ *
+ * Copyright Sam Popham 2020
+ *
+ * this file is part of libdanknn
+ *
+ *  libdanknn is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef DNN_HPP
+#define DNN_HPP
+
+/*
+ * thin C++20 wrapper over the asynchronous inference functions of danknn.h
+ *
+ *	dnn::executor ex(4, 16);
+ *	dnn::model net(ex, dnn_load_net("net.dnn"));
+ *	...
+ *	dnn::output out = co_await net.infer(x);
+ *
+ * a coroutine suspended on infer() is resumed on the executor thread that
+ * ran its forward pass, so until its next co_await it must not block on
+ * that executor (e.g. with model::run()), an output is empty if the pass
+ * failed
+ */
+
+#include <coroutine>
+#include <cstdlib>
+#include <memory>
+#include <new>
+
+#include "danknn.h"
+
+namespace dnn {
+
+struct free_deleter {
+	void operator()(float *p) const { std::free(p); }
+};
+
+/* output vector of a forward pass, sized as the net's output layer */
+using output = std::unique_ptr<float[], free_deleter>;
+
+class executor {
+public:
+	executor(int threads, int max_batch)
+		: ex(dnn_create_executor(threads, max_batch))
+	{
+		if (!ex)
+			throw std::bad_alloc();
+	}
+	~executor() { dnn_destroy_executor(ex); }
+
+	executor(const executor &) = delete;
+	executor &operator=(const executor &) = delete;
+
+	dnn_executor *get() const { return ex; }
+
+private:
+	dnn_executor *ex;
+};
+
+/* awaitable for one submitted forward pass, must be co_awaited */
+class infer_op {
+public:
+	infer_op(dnn_executor *ex, dnn_net *net, const float *inp)
+		: f(dnn_submit(ex, net, inp)) {}
+	~infer_op()
+	{
+		/* never awaited, the output still has to be collected */
+		if (f)
+			std::free(dnn_wait(f));
+	}
+
+	infer_op(const infer_op &) = delete;
+	infer_op &operator=(const infer_op &) = delete;
+
+	bool await_ready() const { return !f || dnn_poll(f) != 0; }
+
+	/* false, i.e. carry on without suspending, if the pass completed
+	 * before the resumption could be registered */
+	bool await_suspend(std::coroutine_handle<> h)
+	{
+		return dnn_future_on_done(f, resume, h.address()) == 0;
+	}
+
+	output await_resume()
+	{
+		dnn_future *done = f;
+
+		f = nullptr;
+		return output(done ? dnn_wait(done) : nullptr);
+	}
+
+private:
+	static void resume(void *addr)
+	{
+		std::coroutine_handle<>::from_address(addr).resume();
+	}
+
+	dnn_future *f;
+};
+
+/* a network bound to the executor that runs it, the network is owned and
+ * destroyed with the model */
+class model {
+public:
+	model(executor &e, dnn_net *net) : ex(e.get()), net(net)
+	{
+		if (!net)
+			throw std::bad_alloc();
+	}
+	~model() { dnn_destroy_net(net); }
+
+	model(const model &) = delete;
+	model &operator=(const model &) = delete;
+
+	infer_op infer(const float *inp) { return infer_op(ex, net, inp); }
+
+	/* blocking, as dnn_test() */
+	output run(const float *inp)
+	{
+		dnn_future *f = dnn_submit(ex, net, inp);
+
+		return output(f ? dnn_wait(f) : nullptr);
+	}
+
+	dnn_net *get() const { return net; }
+
+private:
+	dnn_executor *ex;
+	dnn_net *net;
+};
+
+} /* namespace dnn */
+
+#endif /* DNN_HPP */
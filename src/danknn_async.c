@@ -0,0 +1,363 @@
+/* sam's Dank Neural Network library (libdanknn)
+ *
+ * Copyright Sam Popham 2020
+ *
+ * this file is part of libdanknn
+ *
+ *  libdanknn is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* asynchronous inference
+ *
+ * submitted requests wait in one fifo per executor, a worker takes the
+ * oldest one plus any others queued for the same network, up to max_batch
+ * of them, and runs them as a single batched forward pass */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "danknn_intern.h"
+
+#define FUTURE_PENDING	0
+#define FUTURE_DONE	1
+#define FUTURE_FAILED	-1
+
+struct dnn_future{
+	struct dnn_executor *ex;
+	struct dnn_net *net;
+	float *inp;
+	float *output;
+	int state;
+
+	void (*cb)(void *arg);
+	void *cb_arg;
+
+	struct dnn_future *next;	/* in the queue */
+};
+
+struct dnn_executor{
+	int n_threads;
+	int max_batch;
+	pthread_t *thread;
+
+	/* queue of pending requests, oldest first */
+	struct dnn_future *head;
+	struct dnn_future *tail;
+	int shutdown;
+
+	pthread_mutex_t lock;
+	pthread_cond_t work;	/* signalled when the queue gets a request */
+	pthread_cond_t done;	/* broadcast when any request completes */
+};
+
+struct exec_worker{
+	struct dnn_executor *ex;
+	int idx;
+};
+
+/* takes the oldest request and up to max_batch - 1 more for the same net
+ * out of the queue, called with ex->lock held */
+static int exec_take(struct dnn_executor *ex, struct dnn_future **batch)
+{
+	int n;
+	struct dnn_future *f, *prev;
+
+	batch[0] = ex->head;
+	ex->head = ex->head->next;
+	if(!ex->head)
+		ex->tail = NULL;
+	n = 1;
+
+	prev = NULL;
+	for(f = ex->head; f && n < ex->max_batch; f = f->next){
+		if(f->net != batch[0]->net){
+			prev = f;
+			continue;
+		}
+		batch[n++] = f;
+		if(prev)
+			prev->next = f->next;
+		else
+			ex->head = f->next;
+		if(ex->tail == f)
+			ex->tail = prev;
+	}
+
+	return n;
+}
+
+static void *exec_thread(void *arg)
+{
+	int i, n;
+	int n_out;
+	int max_size;
+	size_t scratch_len, need;
+	float *scratch, *out;
+	float **inp;
+	void (**cb)(void *arg);
+	void **cb_arg;
+	struct dnn_future **batch;
+	struct exec_worker *w = arg;
+	struct dnn_executor *ex = w->ex;
+	struct dnn_net *net;
+
+	dnn_pin_thread(w->idx);
+	free(w);
+
+	batch = malloc(sizeof *batch * ex->max_batch);
+	inp = malloc(sizeof *inp * ex->max_batch);
+	cb = malloc(sizeof *cb * ex->max_batch);
+	cb_arg = malloc(sizeof *cb_arg * ex->max_batch);
+	scratch = NULL;
+	scratch_len = 0;
+	if(!batch || !inp || !cb || !cb_arg){
+		/* the other workers will have to do */
+		free(batch);
+		free(inp);
+		free(cb);
+		free(cb_arg);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&ex->lock);
+	for(;;){
+		while(!ex->head && !ex->shutdown)
+			pthread_cond_wait(&ex->work, &ex->lock);
+		if(!ex->head)
+			break;
+		n = exec_take(ex, batch);
+		pthread_mutex_unlock(&ex->lock);
+
+		net = batch[0]->net;
+		max_size = 0;
+		for(i = 0; i < net->num_lays; ++i)
+			if(net->lay_sizes[i] > max_size)
+				max_size = net->lay_sizes[i];
+		n_out = net->lay_sizes[net->num_lays - 1];
+
+		/* two activation buffers of max_batch * (widest layer) floats,
+		 * kept for the next batch */
+		need = 2 * (size_t)ex->max_batch * max_size;
+		if(need > scratch_len){
+			free(scratch);
+			scratch = malloc(sizeof *scratch * need);
+			scratch_len = scratch ? need : 0;
+		}
+
+		out = NULL;
+		if(scratch){
+			for(i = 0; i < n; ++i)
+				inp[i] = batch[i]->inp;
+			out = dnn_forward_batch(net, inp, n, scratch,
+					&scratch[(size_t)ex->max_batch * max_size]);
+		}
+		for(i = 0; i < n; ++i){
+			if(out)
+				batch[i]->output = malloc(sizeof *batch[i]->output * n_out);
+			if(batch[i]->output)
+				memcpy(batch[i]->output, &out[i * n_out],
+						sizeof *batch[i]->output * n_out);
+		}
+
+		/* the callbacks are copied out before unlocking, once a future
+		 * is marked done its owner may free it */
+		pthread_mutex_lock(&ex->lock);
+		for(i = 0; i < n; ++i){
+			batch[i]->state = batch[i]->output ? FUTURE_DONE : FUTURE_FAILED;
+			cb[i] = batch[i]->cb;
+			cb_arg[i] = batch[i]->cb_arg;
+		}
+		pthread_cond_broadcast(&ex->done);
+		pthread_mutex_unlock(&ex->lock);
+
+		for(i = 0; i < n; ++i)
+			if(cb[i])
+				cb[i](cb_arg[i]);
+
+		pthread_mutex_lock(&ex->lock);
+	}
+	pthread_mutex_unlock(&ex->lock);
+
+	free(scratch);
+	free(batch);
+	free(inp);
+	free(cb);
+	free(cb_arg);
+
+	return NULL;
+}
+
+struct dnn_executor *dnn_create_executor(int threads, int max_batch)
+{
+	int i;
+	struct exec_worker *w;
+	struct dnn_executor *ex;
+
+	if(threads < 1 || max_batch < 1)
+		return NULL;
+
+	ex = calloc(1, sizeof *ex);
+	if(!ex)
+		return NULL;
+	ex->thread = malloc(sizeof *ex->thread * threads);
+	if(!ex->thread){
+		free(ex);
+		return NULL;
+	}
+	ex->max_batch = max_batch;
+	pthread_mutex_init(&ex->lock, NULL);
+	pthread_cond_init(&ex->work, NULL);
+	pthread_cond_init(&ex->done, NULL);
+
+	for(i = 0; i < threads; ++i){
+		w = malloc(sizeof *w);
+		if(!w)
+			break;
+		w->ex = ex;
+		w->idx = i;
+		if(pthread_create(&ex->thread[i], NULL, exec_thread, w)){
+			free(w);
+			break;
+		}
+	}
+	ex->n_threads = i;
+
+	/* no workers, nothing would ever complete */
+	if(!ex->n_threads){
+		dnn_destroy_executor(ex);
+		return NULL;
+	}
+
+	return ex;
+}
+
+struct dnn_future *dnn_submit(struct dnn_executor *ex, struct dnn_net *net,
+		const float *inp)
+{
+	struct dnn_future *f;
+
+	if(!ex || !net || !inp)
+		return NULL;
+
+	f = calloc(1, sizeof *f);
+	if(!f)
+		return NULL;
+	f->inp = malloc(sizeof *f->inp * net->lay_sizes[0]);
+	if(!f->inp){
+		free(f);
+		return NULL;
+	}
+	memcpy(f->inp, inp, sizeof *f->inp * net->lay_sizes[0]);
+	f->ex = ex;
+	f->net = net;
+	f->state = FUTURE_PENDING;
+
+	pthread_mutex_lock(&ex->lock);
+	if(ex->shutdown){
+		pthread_mutex_unlock(&ex->lock);
+		free(f->inp);
+		free(f);
+		return NULL;
+	}
+	if(ex->tail)
+		ex->tail->next = f;
+	else
+		ex->head = f;
+	ex->tail = f;
+	pthread_cond_signal(&ex->work);
+	pthread_mutex_unlock(&ex->lock);
+
+	return f;
+}
+
+int dnn_poll(struct dnn_future *f)
+{
+	int state;
+
+	if(!f)
+		return -1;
+
+	pthread_mutex_lock(&f->ex->lock);
+	state = f->state;
+	pthread_mutex_unlock(&f->ex->lock);
+
+	return state;
+}
+
+int dnn_future_on_done(struct dnn_future *f, void (*cb)(void *arg), void *arg)
+{
+	int ret;
+
+	if(!f || !cb)
+		return -1;
+
+	pthread_mutex_lock(&f->ex->lock);
+	if(f->state == FUTURE_PENDING){
+		f->cb = cb;
+		f->cb_arg = arg;
+		ret = 0;
+	}else{
+		ret = 1;
+	}
+	pthread_mutex_unlock(&f->ex->lock);
+
+	return ret;
+}
+
+float *dnn_wait(struct dnn_future *f)
+{
+	float *output;
+	struct dnn_executor *ex;
+
+	if(!f)
+		return NULL;
+
+	ex = f->ex;
+	pthread_mutex_lock(&ex->lock);
+	while(f->state == FUTURE_PENDING)
+		pthread_cond_wait(&ex->done, &ex->lock);
+	pthread_mutex_unlock(&ex->lock);
+
+	output = f->output;
+	free(f->inp);
+	free(f);
+
+	return output;
+}
+
+int dnn_destroy_executor(struct dnn_executor *ex)
+{
+	int i;
+
+	if(!ex)
+		return -1;
+
+	/* workers drain the queue before they see the shutdown */
+	pthread_mutex_lock(&ex->lock);
+	ex->shutdown = 1;
+	pthread_cond_broadcast(&ex->work);
+	pthread_mutex_unlock(&ex->lock);
+
+	for(i = 0; i < ex->n_threads; ++i)
+		pthread_join(ex->thread[i], NULL);
+
+	pthread_mutex_destroy(&ex->lock);
+	pthread_cond_destroy(&ex->work);
+	pthread_cond_destroy(&ex->done);
+	free(ex->thread);
+	free(ex);
+
+	return 0;
+}
@@ -0,0 +1,580 @@
+/* sam's Dank Neural Network library (libdanknn)
+ *
+ * Copyright Sam Popham 2020
+ *
+ * this file is part of libdanknn
+ *
+ *  libdanknn is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* data-parallel training across processes
+ *
+ * every rank owns a full replica of the network, the ranks are connected
+ * in a ring over tcp (rank r sends to r + 1 and receives from r - 1), and
+ * the summed gradient of each layer is all-reduced around the ring while
+ * the backward pass is still working on the layers below it */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+
+#include "danknn_intern.h"
+
+/* how long to keep retrying the connection to the next rank, which may
+ * not be listening yet */
+#define DIST_CONNECT_TRIES	600
+#define DIST_CONNECT_WAIT_US	50000
+
+struct dnn_dist{
+	struct dnn_net *net;
+	int rank;
+	int world_size;
+	int send_fd;	/* to rank + 1 */
+	int recv_fd;	/* from rank - 1 */
+
+	struct dnn_train **trains;
+	int n_trains;
+
+	/* one bucket per layer holding its biases, its weights, then its
+	 * APTx parameters if it has any, the output layer's bucket has one
+	 * extra trailing float which carries the number of examples summed
+	 * into it so far */
+	float **bucket;
+	int *bucket_len;
+	float *scratch;
+
+	int *n_ready;	/* attached trains done with the backward pass of a layer */
+	int n_reduced;	/* layers reduced this step, from the output layer down */
+	int applying;	/* in dnn_dist_apply(), a rank without trains joins then */
+	int err;
+	int shutdown;
+
+	pthread_t comm;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+/* sends slen bytes to the next rank while receiving rlen bytes from the
+ * previous one, both sides of the ring move at once so neither can fill
+ * its socket buffer and stall the other */
+static int dist_xfer(struct dnn_dist *dist, const void *sbuf, size_t slen,
+		void *rbuf, size_t rlen)
+{
+	struct pollfd pfd[2];
+	size_t sent, recvd;
+	ssize_t n;
+
+	sent = 0;
+	recvd = 0;
+	while(sent < slen || recvd < rlen){
+		pfd[0].fd = sent < slen ? dist->send_fd : -1;
+		pfd[0].events = POLLOUT;
+		pfd[1].fd = recvd < rlen ? dist->recv_fd : -1;
+		pfd[1].events = POLLIN;
+
+		if(poll(pfd, 2, -1) < 0){
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		if(pfd[0].revents & (POLLERR | POLLHUP | POLLNVAL))
+			return -1;
+		if(pfd[0].revents & POLLOUT){
+			n = send(dist->send_fd, (const char *)sbuf + sent,
+					slen - sent, MSG_NOSIGNAL);
+			if(n < 0 && errno != EAGAIN && errno != EINTR)
+				return -1;
+			if(n > 0)
+				sent += n;
+		}
+
+		if(pfd[1].revents & POLLNVAL)
+			return -1;
+		if(pfd[1].revents & (POLLIN | POLLHUP | POLLERR)){
+			n = recv(dist->recv_fd, (char *)rbuf + recvd, rlen - recvd, 0);
+			if(n == 0)
+				return -1;
+			if(n < 0 && errno != EAGAIN && errno != EINTR)
+				return -1;
+			if(n > 0)
+				recvd += n;
+		}
+	}
+
+	return 0;
+}
+
+/* ring all-reduce (sum) of buf in place, a reduce-scatter followed by an
+ * all-gather, each rank moves 2 * (world_size - 1) / world_size * len
+ * floats regardless of how many ranks there are */
+static int dist_allreduce(struct dnn_dist *dist, float *buf, int len)
+{
+	int i, s;
+	int n, r;
+	int send_c, recv_c;
+	long send_off, send_len, recv_off, recv_len;
+
+	n = dist->world_size;
+	r = dist->rank;
+
+#define CHUNK_OFF(c)	((long)len * (c) / n)
+#define CHUNK_LEN(c)	(CHUNK_OFF((c) + 1) - CHUNK_OFF(c))
+
+	for(s = 0; s < n - 1; ++s){
+		send_c = (r - s + n) % n;
+		recv_c = (r - s - 1 + n) % n;
+		send_off = CHUNK_OFF(send_c);
+		send_len = CHUNK_LEN(send_c);
+		recv_off = CHUNK_OFF(recv_c);
+		recv_len = CHUNK_LEN(recv_c);
+
+		if(dist_xfer(dist, &buf[send_off], sizeof *buf * send_len,
+					dist->scratch, sizeof *buf * recv_len))
+			return -1;
+		for(i = 0; i < recv_len; ++i)
+			buf[recv_off + i] += dist->scratch[i];
+	}
+
+	for(s = 0; s < n - 1; ++s){
+		send_c = (r - s + 1 + n) % n;
+		recv_c = (r - s + n) % n;
+
+		if(dist_xfer(dist, &buf[CHUNK_OFF(send_c)], sizeof *buf * CHUNK_LEN(send_c),
+					&buf[CHUNK_OFF(recv_c)], sizeof *buf * CHUNK_LEN(recv_c)))
+			return -1;
+	}
+
+#undef CHUNK_OFF
+#undef CHUNK_LEN
+
+	return 0;
+}
+
+/* sums the gradients of every attached train into the layer's bucket,
+ * then all-reduces it with the other ranks */
+static int dist_reduce_layer(struct dnn_dist *dist, int lay)
+{
+	int i, j;
+	int n_out, n_wts, n_aptx;
+	float unscale;
+	float *b;
+	struct dnn_d_layer *d_lay;
+
+	b = dist->bucket[lay];
+	n_out = dist->net->lay_sizes[lay];
+	n_wts = n_out * dist->net->lay_sizes[lay - 1];
+	n_aptx = 3 * dist->net->lays[lay - 1].n_aptx;
+
+	memset(b, 0, sizeof *b * dist->bucket_len[lay]);
+	for(i = 0; i < dist->n_trains; ++i){
+		d_lay = &dist->trains[i]->d_lays[lay];
+		if(dist->trains[i]->precision == DNN_PREC_BF16){
+			unscale = 1 / dist->trains[i]->loss_scale;
+			for(j = 0; j < n_out; ++j)
+				b[j] += unscale * d_lay->d_bias[j];
+			for(j = 0; j < n_wts; ++j)
+				b[n_out + j] += unscale * dnn_bf16_to_f32(d_lay->bf_d_wm[j]);
+			for(j = 0; j < n_aptx; ++j)
+				b[n_out + n_wts + j] += unscale * d_lay->d_aptx[j];
+			continue;
+		}
+		for(j = 0; j < n_out; ++j)
+			b[j] += d_lay->d_bias[j];
+		for(j = 0; j < n_wts; ++j)
+			b[n_out + j] += d_lay->d_wm_alloc_handle[j];
+		for(j = 0; j < n_aptx; ++j)
+			b[n_out + n_wts + j] += d_lay->d_aptx[j];
+	}
+	if(lay == dist->net->num_lays - 1)
+		b[dist->bucket_len[lay] - 1] = dist->n_trains;
+
+	if(dist->world_size == 1)
+		return 0;
+	return dist_allreduce(dist, b, dist->bucket_len[lay]);
+}
+
+/* communication thread, reduces layers in the order the backward pass
+ * finishes them, which is the same on every rank, a rank with no trains
+ * attached reduces zero buckets (counting 0 examples) once
+ * dnn_dist_apply() is called so the other ranks aren't left waiting */
+static void *dist_comm(void *arg)
+{
+	int lay;
+	int err;
+	struct dnn_dist *dist = arg;
+
+	pthread_mutex_lock(&dist->lock);
+	for(;;){
+		lay = dist->net->num_lays - 1 - dist->n_reduced;
+		while(!dist->shutdown && (lay < 1 || (dist->n_trains == 0 ?
+					!dist->applying : dist->n_ready[lay] < dist->n_trains))){
+			pthread_cond_wait(&dist->cond, &dist->lock);
+			lay = dist->net->num_lays - 1 - dist->n_reduced;
+		}
+		if(dist->shutdown)
+			break;
+
+		pthread_mutex_unlock(&dist->lock);
+		err = dist_reduce_layer(dist, lay);
+		pthread_mutex_lock(&dist->lock);
+
+		dist->err |= err;
+		++dist->n_reduced;
+		pthread_cond_broadcast(&dist->cond);
+	}
+	pthread_mutex_unlock(&dist->lock);
+
+	return NULL;
+}
+
+static int dist_connect(const char *host, int port)
+{
+	int i;
+	int fd;
+	int one;
+	char port_str[16];
+	struct addrinfo hints, *res, *ai;
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	snprintf(port_str, sizeof port_str, "%d", port);
+
+	if(getaddrinfo(host, port_str, &hints, &res))
+		return -1;
+
+	fd = -1;
+	for(i = 0; i < DIST_CONNECT_TRIES && fd < 0; ++i){
+		for(ai = res; ai; ai = ai->ai_next){
+			fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+			if(fd < 0)
+				continue;
+			if(!connect(fd, ai->ai_addr, ai->ai_addrlen))
+				break;
+			close(fd);
+			fd = -1;
+		}
+		if(fd < 0)
+			usleep(DIST_CONNECT_WAIT_US);
+	}
+	freeaddrinfo(res);
+
+	if(fd < 0)
+		return -1;
+
+	one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+
+	return fd;
+}
+
+static int dist_listen(int port)
+{
+	int fd;
+	int one;
+	struct sockaddr_in addr;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if(fd < 0)
+		return -1;
+
+	one = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+
+	memset(&addr, 0, sizeof addr);
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+
+	if(bind(fd, (struct sockaddr *)&addr, sizeof addr) || listen(fd, 1)){
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+struct dnn_dist *dnn_dist_create(struct dnn_net *net, int rank, int world_size,
+		const char *next_host, int base_port)
+{
+	int i;
+	int one;
+	int lfd;
+	int max_chunk;
+	struct dnn_dist *dist;
+
+	if(!net)
+		return NULL;
+	if(world_size < 1 || rank < 0 || rank >= world_size)
+		return NULL;
+	if(world_size > 1 && (!next_host || base_port <= 0))
+		return NULL;
+	/* buckets are laid out for dense weights */
+	if(dnn_net_has_lowrank(net))
+		return NULL;
+
+	dist = calloc(1, sizeof *dist);
+	if(!dist)
+		return NULL;
+	dist->net = net;
+	dist->rank = rank;
+	dist->world_size = world_size;
+	dist->send_fd = -1;
+	dist->recv_fd = -1;
+
+	dist->bucket = calloc(net->num_lays, sizeof *dist->bucket);
+	dist->bucket_len = calloc(net->num_lays, sizeof *dist->bucket_len);
+	dist->n_ready = calloc(net->num_lays, sizeof *dist->n_ready);
+	if(!dist->bucket || !dist->bucket_len || !dist->n_ready)
+		goto fail;
+
+	max_chunk = 0;
+	for(i = 1; i < net->num_lays; ++i){
+		dist->bucket_len[i] = net->lay_sizes[i] * (net->lay_sizes[i - 1] + 1) +
+			3 * net->lays[i - 1].n_aptx;
+		if(i == net->num_lays - 1)
+			++dist->bucket_len[i];
+		dist->bucket[i] = malloc(sizeof *dist->bucket[i] * dist->bucket_len[i]);
+		if(!dist->bucket[i])
+			goto fail;
+		if(dist->bucket_len[i] / world_size + 1 > max_chunk)
+			max_chunk = dist->bucket_len[i] / world_size + 1;
+	}
+	dist->scratch = malloc(sizeof *dist->scratch * max_chunk);
+	if(!dist->scratch)
+		goto fail;
+
+	if(world_size > 1){
+		/* listen before connecting so the previous rank can always
+		 * get through, then the ring closes once everyone accepts */
+		lfd = dist_listen(base_port + rank);
+		if(lfd < 0)
+			goto fail;
+		dist->send_fd = dist_connect(next_host, base_port + (rank + 1) % world_size);
+		if(dist->send_fd >= 0)
+			dist->recv_fd = accept(lfd, NULL, NULL);
+		close(lfd);
+		if(dist->send_fd < 0 || dist->recv_fd < 0)
+			goto fail;
+
+		one = 1;
+		setsockopt(dist->recv_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+		fcntl(dist->send_fd, F_SETFL, fcntl(dist->send_fd, F_GETFL) | O_NONBLOCK);
+		fcntl(dist->recv_fd, F_SETFL, fcntl(dist->recv_fd, F_GETFL) | O_NONBLOCK);
+	}
+
+	pthread_mutex_init(&dist->lock, NULL);
+	pthread_cond_init(&dist->cond, NULL);
+	if(pthread_create(&dist->comm, NULL, dist_comm, dist)){
+		pthread_mutex_destroy(&dist->lock);
+		pthread_cond_destroy(&dist->cond);
+		goto fail;
+	}
+	__atomic_add_fetch(&net->n_dist, 1, __ATOMIC_SEQ_CST);
+
+	return dist;
+
+fail:
+	if(dist->send_fd >= 0)
+		close(dist->send_fd);
+	if(dist->recv_fd >= 0)
+		close(dist->recv_fd);
+	if(dist->bucket)
+		for(i = 0; i < net->num_lays; ++i)
+			free(dist->bucket[i]);
+	free(dist->bucket);
+	free(dist->bucket_len);
+	free(dist->n_ready);
+	free(dist->scratch);
+	free(dist);
+
+	return NULL;
+}
+
+int dnn_dist_attach(struct dnn_dist *dist, struct dnn_train *train)
+{
+	struct dnn_train **trains;
+
+	if(!dist || !train)
+		return -1;
+	if(train->net != dist->net || train->dist)
+		return -1;
+
+	pthread_mutex_lock(&dist->lock);
+	trains = realloc(dist->trains, sizeof *trains * (dist->n_trains + 1));
+	if(!trains){
+		pthread_mutex_unlock(&dist->lock);
+		return -1;
+	}
+	dist->trains = trains;
+	dist->trains[dist->n_trains++] = train;
+	train->dist = dist;
+	pthread_mutex_unlock(&dist->lock);
+
+	return 0;
+}
+
+/* called by dnn_train() as soon as the gradients of layer lay are final */
+void dnn_dist_layer_done(struct dnn_dist *dist, int lay)
+{
+	pthread_mutex_lock(&dist->lock);
+	if(++dist->n_ready[lay] == dist->n_trains)
+		pthread_cond_broadcast(&dist->cond);
+	pthread_mutex_unlock(&dist->lock);
+}
+
+int dnn_dist_apply(struct dnn_dist *dist, float train_aggr)
+{
+	int i, j;
+	int n_out, n_wts;
+	int err;
+	float count;
+	float *b;
+	struct dnn_net *net;
+
+	if(!dist)
+		return -1;
+	net = dist->net;
+
+	pthread_mutex_lock(&dist->lock);
+	dist->applying = 1;
+	pthread_cond_broadcast(&dist->cond);
+	while(dist->n_reduced < net->num_lays - 1)
+		pthread_cond_wait(&dist->cond, &dist->lock);
+	dist->applying = 0;
+
+	err = dist->err;
+	count = dist->bucket[net->num_lays - 1][dist->bucket_len[net->num_lays - 1] - 1];
+	if(!err && count > 0){
+		for(i = 1; i < net->num_lays; ++i){
+			b = dist->bucket[i];
+			n_out = net->lay_sizes[i];
+			n_wts = n_out * net->lay_sizes[i - 1];
+			for(j = 0; j < n_out; ++j)
+				net->lays[i - 1].bias[j] += -1 * train_aggr / count * b[j];
+			for(j = 0; j < n_wts; ++j)
+				net->lays[i - 1].wm_alloc_handle[j] += -1 * train_aggr / count * b[n_out + j];
+			for(j = 0; j < 3 * net->lays[i - 1].n_aptx; ++j)
+				net->lays[i - 1].aptx[j] += -1 * train_aggr / count * b[n_out + n_wts + j];
+			dnn_pack_layer(net, i - 1);
+		}
+	}
+
+	for(i = 0; i < net->num_lays; ++i)
+		dist->n_ready[i] = 0;
+	dist->n_reduced = 0;
+	dist->err = 0;
+	pthread_mutex_unlock(&dist->lock);
+
+	return err ? -1 : 0;
+}
+
+int dnn_dist_bcast_net(struct dnn_dist *dist)
+{
+	int i;
+	size_t bias_len, wts_len, aptx_len;
+	struct dnn_net *net;
+
+	if(!dist)
+		return -1;
+	if(dist->world_size == 1)
+		return 0;
+	net = dist->net;
+
+	/* rank 0's parameters travel once around the ring, the last rank
+	 * does not send them back */
+	pthread_mutex_lock(&dist->lock);
+	for(i = 0; i < net->num_lays - 1; ++i){
+		bias_len = sizeof *net->lays[i].bias * net->lay_sizes[i + 1];
+		wts_len = sizeof *net->lays[i].wm_alloc_handle * net->lay_sizes[i] * net->lay_sizes[i + 1];
+
+		aptx_len = sizeof *net->lays[i].aptx * 3 * net->lays[i].n_aptx;
+
+		if(dist->rank != 0 &&
+				(dist_xfer(dist, NULL, 0, net->lays[i].bias, bias_len) ||
+				 dist_xfer(dist, NULL, 0, net->lays[i].wm_alloc_handle, wts_len) ||
+				 dist_xfer(dist, NULL, 0, net->lays[i].aptx, aptx_len)))
+			break;
+		if(dist->rank != dist->world_size - 1 &&
+				(dist_xfer(dist, net->lays[i].bias, bias_len, NULL, 0) ||
+				 dist_xfer(dist, net->lays[i].wm_alloc_handle, wts_len, NULL, 0) ||
+				 dist_xfer(dist, net->lays[i].aptx, aptx_len, NULL, 0)))
+			break;
+	}
+	pthread_mutex_unlock(&dist->lock);
+	dnn_repack_net(net);
+
+	return i == net->num_lays - 1 ? 0 : -1;
+}
+
+int dnn_dist_rank(struct dnn_dist *dist)
+{
+	if(!dist)
+		return -1;
+	return dist->rank;
+}
+
+int dnn_dist_world_size(struct dnn_dist *dist)
+{
+	if(!dist)
+		return -1;
+	return dist->world_size;
+}
+
+int dnn_dist_destroy(struct dnn_dist *dist)
+{
+	int i;
+
+	if(!dist)
+		return -1;
+
+	pthread_mutex_lock(&dist->lock);
+	dist->shutdown = 1;
+	pthread_cond_broadcast(&dist->cond);
+	pthread_mutex_unlock(&dist->lock);
+	pthread_join(dist->comm, NULL);
+
+	for(i = 0; i < dist->n_trains; ++i)
+		dist->trains[i]->dist = NULL;
+
+	if(dist->send_fd >= 0)
+		close(dist->send_fd);
+	if(dist->recv_fd >= 0)
+		close(dist->recv_fd);
+
+	for(i = 0; i < dist->net->num_lays; ++i)
+		free(dist->bucket[i]);
+	free(dist->bucket);
+	free(dist->bucket_len);
+	free(dist->n_ready);
+	free(dist->scratch);
+	free(dist->trains);
+	__atomic_sub_fetch(&dist->net->n_dist, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_destroy(&dist->lock);
+	pthread_cond_destroy(&dist->cond);
+	free(dist);
+
+	return 0;
+}
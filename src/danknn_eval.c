@@ -0,0 +1,268 @@
+/* sam's Dank Neural Network library (libdanknn)
+ *
+ * Copyright Sam Popham 2020
+ *
+ * this file is part of libdanknn
+ *
+ *  libdanknn is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* dataset evaluation, forward passes are run EVAL_BATCH examples at a
+ * time so each weight row is loaded once per batch instead of once per
+ * example, and the outputs are reduced to argmax/loss straight out of the
+ * last layer's scratch buffer */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "danknn_intern.h"
+
+#define EVAL_BATCH	16
+/* smallest probability fed to log() by DNN_METRIC_XENT */
+#define EVAL_XENT_EPS	1e-7f
+
+struct eval_job{
+	struct dnn_net *net;
+	float **inputs;
+	int *labels;
+	int n;
+	int metric;
+
+	/* per thread results, merged once everyone is done */
+	int n_correct;
+	double loss;
+	int *confusion;
+	int err;
+	int idx;	/* position in the thread group */
+};
+
+/* forward pass of n_b examples, act_in/act_out are scratch buffers of
+ * n_b * (widest layer) floats, returns the buffer holding the output layer,
+ * example b's outputs starting at b * output size */
+float *dnn_forward_batch(struct dnn_net *net, float **inp, int n_b,
+		float *act_in, float *act_out)
+{
+	int i, j, k, b;
+	int jb, j_end, rb;
+	int n_in, n_out;
+	float *tmp;
+
+	n_in = net->lay_sizes[0];
+	for(b = 0; b < n_b; ++b)
+		for(k = 0; k < n_in; ++k)
+			act_in[b * n_in + k] = inp[b][k];
+
+	for(i = 0; i < net->num_lays - 1; ++i){
+		n_in = net->lay_sizes[i];
+		n_out = net->lay_sizes[i + 1];
+		/* push every example through a block of rows while the block
+		 * is still in cache */
+		rb = net->lays[i].row_block ? net->lays[i].row_block : n_out;
+		for(jb = 0; jb < n_out; jb += rb){
+			j_end = jb + rb < n_out ? jb + rb : n_out;
+			for(b = 0; b < n_b; ++b)
+				dnn_lay_matvec(net, i, jb, j_end, &act_in[b * n_in], &act_out[b * n_out]);
+		}
+		for(b = 0; b < n_b; ++b){
+			for(j = 0; j < n_out; ++j)
+				act_out[b * n_out + j] += net->lays[i].bias[j];
+			dnn_activate(net, i, &act_out[b * n_out], &act_out[b * n_out]);
+		}
+		tmp = act_in;
+		act_in = act_out;
+		act_out = tmp;
+	}
+
+	return act_in;
+}
+
+static void *eval_thread(void *arg)
+{
+	int i, j, b;
+	int n_b;
+	int n_out;
+	int max_size;
+	int guess;
+	float d;
+	float *out;
+	float *act_in, *act_out;
+	struct eval_job *job = arg;
+	struct dnn_net *net = job->net;
+
+	max_size = 0;
+	for(i = 0; i < net->num_lays; ++i)
+		if(net->lay_sizes[i] > max_size)
+			max_size = net->lay_sizes[i];
+
+	act_in = malloc(sizeof *act_in * EVAL_BATCH * max_size);
+	act_out = malloc(sizeof *act_out * EVAL_BATCH * max_size);
+	if(!act_in || !act_out){
+		free(act_in);
+		free(act_out);
+		job->err = -1;
+		return NULL;
+	}
+
+	n_out = net->lay_sizes[net->num_lays - 1];
+	for(i = 0; i < job->n; i += EVAL_BATCH){
+		n_b = job->n - i < EVAL_BATCH ? job->n - i : EVAL_BATCH;
+		out = dnn_forward_batch(net, &job->inputs[i], n_b, act_in, act_out);
+
+		for(b = 0; b < n_b; ++b, out += n_out){
+			guess = 0;
+			for(j = 1; j < n_out; ++j)
+				if(out[j] > out[guess])
+					guess = j;
+
+			++job->confusion[job->labels[i + b] * n_out + guess];
+			if(guess == job->labels[i + b])
+				++job->n_correct;
+
+			if(job->metric == DNN_METRIC_XENT){
+				d = out[job->labels[i + b]];
+				job->loss -= log(d > EVAL_XENT_EPS ? d : EVAL_XENT_EPS);
+			}else{
+				for(j = 0; j < n_out; ++j){
+					d = out[j] - (j == job->labels[i + b]);
+					job->loss += d * d;
+				}
+			}
+		}
+	}
+
+	free(act_in);
+	free(act_out);
+
+	return NULL;
+}
+
+/* entry point of the spawned threads, the caller's own thread isn't
+ * pinned since it goes back to the caller afterwards */
+static void *eval_worker(void *arg)
+{
+	struct eval_job *job = arg;
+
+	dnn_pin_thread(job->idx);
+
+	return eval_thread(job);
+}
+
+struct dnn_eval *dnn_evaluate(struct dnn_net *net, float **inputs, int *labels,
+		int n, int metric, int threads)
+{
+	int i, j;
+	int n_out;
+	int err;
+	double loss;
+	pthread_t *thread;
+	struct eval_job *job;
+	struct dnn_eval *eval;
+
+	if(!net || !inputs || !labels || n < 1)
+		return NULL;
+	if(metric != DNN_METRIC_MSE && metric != DNN_METRIC_XENT)
+		return NULL;
+
+	n_out = net->lay_sizes[net->num_lays - 1];
+	for(i = 0; i < n; ++i)
+		if(labels[i] < 0 || labels[i] >= n_out)
+			return NULL;
+
+	if(threads < 1)
+		threads = 1;
+	if(threads > n)
+		threads = n;
+
+	eval = calloc(1, sizeof *eval);
+	thread = malloc(sizeof *thread * threads);
+	job = calloc(threads, sizeof *job);
+	if(!eval || !thread || !job)
+		goto fail;
+	eval->confusion = calloc(n_out * n_out, sizeof *eval->confusion);
+	if(!eval->confusion)
+		goto fail;
+
+	/* contiguous slices so each thread walks its inputs in order */
+	for(i = 0; i < threads; ++i){
+		job[i].net = net;
+		job[i].idx = i;
+		job[i].metric = metric;
+		job[i].inputs = &inputs[(long)n * i / threads];
+		job[i].labels = &labels[(long)n * i / threads];
+		job[i].n = (long)n * (i + 1) / threads - (long)n * i / threads;
+		job[i].confusion = calloc(n_out * n_out, sizeof *job[i].confusion);
+		if(!job[i].confusion)
+			goto fail;
+	}
+
+	err = 0;
+	for(i = 1; i < threads; ++i)
+		if(pthread_create(&thread[i], NULL, eval_worker, &job[i])){
+			/* run what didn't get a thread on this one */
+			eval_thread(&job[i]);
+			thread[i] = pthread_self();
+		}
+	eval_thread(&job[0]);
+	for(i = 1; i < threads; ++i)
+		if(!pthread_equal(thread[i], pthread_self()))
+			pthread_join(thread[i], NULL);
+
+	eval->n = n;
+	eval->n_classes = n_out;
+	eval->n_correct = 0;
+	loss = 0;
+	for(i = 0; i < threads; ++i){
+		err |= job[i].err;
+		eval->n_correct += job[i].n_correct;
+		loss += job[i].loss;
+		for(j = 0; j < n_out * n_out; ++j)
+			eval->confusion[j] += job[i].confusion[j];
+	}
+	if(err)
+		goto fail;
+	eval->accuracy = (float)eval->n_correct / n;
+	eval->mean_loss = loss / n;
+
+	for(i = 0; i < threads; ++i)
+		free(job[i].confusion);
+	free(job);
+	free(thread);
+
+	return eval;
+
+fail:
+	if(job)
+		for(i = 0; i < threads; ++i)
+			free(job[i].confusion);
+	free(job);
+	free(thread);
+	if(eval)
+		free(eval->confusion);
+	free(eval);
+
+	return NULL;
+}
+
+int dnn_destroy_eval(struct dnn_eval *eval)
+{
+	if(!eval)
+		return -1;
+
+	free(eval->confusion);
+	free(eval);
+
+	return 0;
+}
@@ -0,0 +1,212 @@
+/* sam's Dank Neural Network library (libdanknn)
+ *
+ * Copyright Sam Popham 2020
+ *
+ * this file is part of libdanknn
+ *
+ *  libdanknn is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* incremental evaluation of inputs that change a few features at a time
+ *
+ * the first layer's weighted sums are kept between calls and moved by
+ * (new - old) * column k of the weights for each changed input k, read
+ * from the net's transposed copy of the first layer (wm_t) so every
+ * column is contiguous, only the layers after it are recomputed in full
+ * wm_t is packed by the first context on a net, under a lock, and after
+ * that only read, so contexts may be built on a net that other threads
+ * are serving from */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "danknn_intern.h"
+
+/* updates between full recomputes of the accumulator, so the rounding
+ * error of adding and subtracting columns can't build up */
+#define INC_REFRESH	4096
+
+/* held while giving a net its first layer wm_t */
+static pthread_mutex_t inc_pack_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct dnn_incremental{
+	struct dnn_net *net;
+	float *inp;	/* the current input */
+	float *acc;	/* first layer weighted sums of inp, without bias */
+	float *act_in;	/* scratch for the later layers, widest layer each */
+	float *act_out;
+	float *output;
+	int n_updates;	/* since the accumulator was last recomputed */
+};
+
+/* gives net's first layer its transposed copy if nothing has yet, the
+ * backward pass's copy is the same so a net being trained already has it */
+static int inc_pack(struct dnn_net *net)
+{
+	struct dnn_layer *lay = &net->lays[0];
+
+	pthread_mutex_lock(&inc_pack_lock);
+	if(!lay->wm_t){
+		lay->wm_t = dnn_alloc_buf(sizeof *lay->wm_t *
+				net->lay_sizes[0] * net->lay_sizes[1]);
+		if(!lay->wm_t){
+			pthread_mutex_unlock(&inc_pack_lock);
+			return -1;
+		}
+		dnn_pack_layer(net, 0);
+	}
+	pthread_mutex_unlock(&inc_pack_lock);
+
+	return 0;
+}
+
+static void inc_refresh(struct dnn_incremental *inc)
+{
+	dnn_lay_matvec(inc->net, 0, 0, inc->net->lay_sizes[1], inc->inp, inc->acc);
+	inc->n_updates = 0;
+}
+
+/* everything after the accumulator, leaves the output in inc->output */
+static float *inc_finish(struct dnn_incremental *inc)
+{
+	int i, j;
+	int n_out;
+	float *tmp, *a_in, *a_out;
+	struct dnn_net *net = inc->net;
+
+	a_in = inc->act_in;
+	a_out = inc->act_out;
+	for(j = 0; j < net->lay_sizes[1]; ++j)
+		a_in[j] = inc->acc[j] + net->lays[0].bias[j];
+	dnn_activate(net, 0, a_in, a_in);
+
+	for(i = 1; i < net->num_lays - 1; ++i){
+		dnn_lay_matvec(net, i, 0, net->lay_sizes[i + 1], a_in, a_out);
+		for(j = 0; j < net->lay_sizes[i + 1]; ++j)
+			a_out[j] += net->lays[i].bias[j];
+		dnn_activate(net, i, a_out, a_out);
+		tmp = a_in;
+		a_in = a_out;
+		a_out = tmp;
+	}
+
+	n_out = net->lay_sizes[net->num_lays - 1];
+	memcpy(inc->output, a_in, sizeof *inc->output * n_out);
+
+	return inc->output;
+}
+
+int dnn_destroy_incremental(struct dnn_incremental *inc)
+{
+	if(!inc)
+		return -1;
+
+	free(inc->inp);
+	free(inc->acc);
+	free(inc->act_in);
+	free(inc->act_out);
+	free(inc->output);
+	free(inc);
+
+	return 0;
+}
+
+struct dnn_incremental *dnn_create_incremental(struct dnn_net *net, float *inp)
+{
+	int i;
+	int max_size;
+	struct dnn_incremental *inc;
+
+	if(!net || !inp)
+		return NULL;
+	if(net->lays[0].rank)
+		return NULL;
+	if(inc_pack(net))
+		return NULL;
+
+	max_size = 0;
+	for(i = 1; i < net->num_lays; ++i)
+		if(net->lay_sizes[i] > max_size)
+			max_size = net->lay_sizes[i];
+
+	inc = calloc(1, sizeof *inc);
+	if(!inc)
+		return NULL;
+	inc->net = net;
+	inc->inp = malloc(sizeof *inc->inp * net->lay_sizes[0]);
+	inc->acc = malloc(sizeof *inc->acc * net->lay_sizes[1]);
+	inc->act_in = malloc(sizeof *inc->act_in * max_size);
+	inc->act_out = malloc(sizeof *inc->act_out * max_size);
+	inc->output = malloc(sizeof *inc->output * net->lay_sizes[net->num_lays - 1]);
+	if(!inc->inp || !inc->acc || !inc->act_in || !inc->act_out || !inc->output){
+		dnn_destroy_incremental(inc);
+		return NULL;
+	}
+
+	memcpy(inc->inp, inp, sizeof *inc->inp * net->lay_sizes[0]);
+	inc_refresh(inc);
+
+	return inc;
+}
+
+float *dnn_inc_reset(struct dnn_incremental *inc, float *inp)
+{
+	if(!inc)
+		return NULL;
+
+	if(inp)
+		memcpy(inc->inp, inp, sizeof *inc->inp * inc->net->lay_sizes[0]);
+	inc_refresh(inc);
+
+	return inc_finish(inc);
+}
+
+float *dnn_inc_update(struct dnn_incremental *inc, int n, const int *idx,
+		const float *vals)
+{
+	int i, j, k;
+	int n_in, n_out;
+	float d;
+	float *acc;
+	const float *wt;
+
+	if(!inc || n < 0 || (n && (!idx || !vals)))
+		return NULL;
+	if(inc->net->lays[0].rank)
+		return NULL;
+
+	n_in = inc->net->lay_sizes[0];
+	n_out = inc->net->lay_sizes[1];
+	for(i = 0; i < n; ++i)
+		if(idx[i] < 0 || idx[i] >= n_in)
+			return NULL;
+
+	acc = inc->acc;
+	for(i = 0; i < n; ++i){
+		k = idx[i];
+		d = vals[i] - inc->inp[k];
+		if(d == 0)
+			continue;
+		inc->inp[k] = vals[i];
+		wt = &inc->net->lays[0].wm_t[(size_t)k * n_out];
+		for(j = 0; j < n_out; ++j)
+			acc[j] += d * wt[j];
+	}
+
+	if(++inc->n_updates >= INC_REFRESH)
+		inc_refresh(inc);
+
+	return inc_finish(inc);
+}
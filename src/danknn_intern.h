@@ -20,11 +20,40 @@
 #ifndef DNN_INTERN
 #define DNN_INTERN
 
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "danknn.h"
+
 struct dnn_layer{
 	float **wm;
 	float *wm_alloc_handle;
 	float *bias;
 	float (*actv_func)(float inp);
+
+	/* wm transposed, wm_t[k * n_out + j] == wm[j][k], allocated by the
+	 * first dnn_create_train() on the net and repacked whenever the
+	 * library changes the weights */
+	float *wm_t;
+
+	/* matvec kernel (index into dnn_mv_kerns) and row block, 0 meaning
+	 * the whole layer, chosen by dnn_autotune() */
+	int kern;
+	int row_block;
+
+	/* trainable APTx activation, n_aptx sets of parameters (1 for the
+	 * whole layer or 1 per neuron) stored as alpha[n_aptx], beta[n_aptx],
+	 * gamma[n_aptx], NULL/0 when the layer uses actv_func instead */
+	float *aptx;
+	int n_aptx;
+
+	/* low rank factors, wm ~= lr_u * lr_v with lr_u n_out * rank and
+	 * lr_v rank * n_in, both row major, see dnn_compress_lowrank(), wm,
+	 * wm_alloc_handle and wm_t are NULL while rank is nonzero */
+	int rank;
+	float *lr_u;
+	float *lr_v;
 };
 
 struct dnn_d_layer{
@@ -32,30 +61,175 @@ struct dnn_d_layer{
 	float *d_wm_alloc_handle;
 	float *d_bias;
 	float (*d_actv_func)(float inp);
+	/* APTx parameter gradients, laid out like dnn_layer.aptx */
+	float *d_aptx;
+	int n_d_aptx;
+	/* low rank factor gradients, laid out like dnn_layer.lr_u/lr_v, and
+	 * the rank sized intermediate lr_v * act of the layer below */
+	float *d_lr_u;
+	float *d_lr_v;
+	float *lr_t;
+	float *d_lr_t;
+	int n_d_rank;
 
 	float *wtd_sum;
 	float *d_wtd_sum;
 
 	float *act;
 	float *d_act;
+
+	/* DNN_PREC_BF16 replacements for the buffers above, the fp32 ones
+	 * are NULL while these are in use and vice versa */
+	uint16_t *bf_wtd_sum;
+	uint16_t *bf_d_wtd_sum;
+	uint16_t *bf_act;
+	uint16_t *bf_d_act;
+	uint16_t *bf_d_wm;
 };
 
 struct dnn_train{
 	struct dnn_net *net;
 	struct dnn_d_layer *d_lays;
 	float (*d_cost)(float out, float want);
+	struct dnn_dist *dist;
+
+	int precision;
+	float loss_scale;
 };
 
 struct dnn_net{
 	int num_lays;
 	int *lay_sizes;
 	struct dnn_layer *lays;
+	int out_mode;	/* DNN_OUT_ACT or DNN_OUT_SOFTMAX */
+	int n_dist;	/* dnn_dist contexts laid out for these weights */
 };
 
+/* bf16 is the top half of an fp32, rounded to nearest even */
+static inline uint16_t dnn_f32_to_bf16(float x)
+{
+	uint32_t u;
+
+	memcpy(&u, &x, sizeof u);
+	if((u & 0x7fffffff) > 0x7f800000)
+		return (u >> 16) | 0x40;	/* keep nans quiet */
+	u += 0x7fff + ((u >> 16) & 1);
+	return u >> 16;
+}
+
+static inline float dnn_bf16_to_f32(uint16_t h)
+{
+	uint32_t u;
+	float x;
+
+	u = (uint32_t)h << 16;
+	memcpy(&x, &u, sizeof x);
+	return x;
+}
+
+/* dense layer kernels, out[j] = w[j] . x for n_rows rows of n_in weights,
+ * see danknn_tune.c */
+typedef void (*dnn_mv_kern)(const float *w, int n_in, int n_rows,
+		const float *x, float *out);
+#define DNN_N_KERNS	4
+extern const dnn_mv_kern dnn_mv_kerns[DNN_N_KERNS];
+
+/* dnn_lay_matvec() of a factored layer, t gets the rank intermediate
+ * lr_v * x, then rows [j0, j1) of lr_u * t are written to out */
+static inline void dnn_lowrank_matvec(struct dnn_net *net, int lay, int j0, int j1,
+		const float *x, float *t, float *out)
+{
+	struct dnn_layer *l = &net->lays[lay];
+
+	dnn_mv_kerns[l->kern](l->lr_v, net->lay_sizes[lay], l->rank, x, t);
+	dnn_mv_kerns[l->kern](&l->lr_u[j0 * l->rank], l->rank, j1 - j0, t, &out[j0]);
+}
+
+/* weighted sums (without bias) of rows [j0, j1) of layer lay of net for
+ * input x, written to out[j0] to out[j1 - 1] */
+static inline void dnn_lay_matvec(struct dnn_net *net, int lay, int j0, int j1,
+		const float *x, float *out)
+{
+	if(net->lays[lay].rank){
+		float t[DNN_MAX_RANK];
+
+		dnn_lowrank_matvec(net, lay, j0, j1, x, t, out);
+		return;
+	}
+	dnn_mv_kerns[net->lays[lay].kern](net->lays[lay].wm[j0],
+			net->lay_sizes[lay], j1 - j0, x, &out[j0]);
+}
+
+/* tanh as a 13/6 rational function, within a few ulp of tanhf() and with
+ * no library call or branch so layer loops over it vectorize
+ * |x| is clamped to 7.9053111 (0x40fcf84f), past which tanh is 1 to float
+ * precision, on the bits, as a float compare keeps gcc from if-converting
+ * the loop without -fno-trapping-math, a nan comes out as +-1 */
+static inline float dnn_tanh(float x)
+{
+	uint32_t u, sign;
+	float x2, p, q;
+
+	memcpy(&u, &x, sizeof u);
+	sign = u & 0x80000000;
+	u &= 0x7fffffff;
+	u = u > 0x40fcf84f ? 0x40fcf84f : u;
+	u |= sign;
+	memcpy(&x, &u, sizeof x);
+	x2 = x * x;
+	p = -2.76076847742355e-16f;
+	p = p * x2 + 2.00018790482477e-13f;
+	p = p * x2 - 8.60467152213735e-11f;
+	p = p * x2 + 5.12229709037114e-08f;
+	p = p * x2 + 1.48572235717979e-05f;
+	p = p * x2 + 6.37261928875436e-04f;
+	p = p * x2 + 4.89352455891786e-03f;
+	q = 1.19825839466702e-06f;
+	q = q * x2 + 1.18534705686654e-04f;
+	q = q * x2 + 2.26843463243900e-03f;
+	q = q * x2 + 4.89352518554385e-03f;
+	return x * p / q;
+}
+
+/* APTx with trainable parameters prm (see dnn_layer.aptx) for neuron j */
+static inline float dnn_aptx(const float *prm, int n_prm, int j, float z)
+{
+	int q;
+
+	q = n_prm > 1 ? j : 0;
+	return (prm[q] + dnn_tanh(prm[n_prm + q] * z)) * prm[2 * n_prm + q] * z;
+}
+
+/* backward through APTx for neuron j with weighted sum z and output
+ * gradient d_a, adds the parameter gradients to d_prm and returns the
+ * gradient of the weighted sum */
+static inline float dnn_aptx_backward(const float *prm, float *d_prm, int n_prm,
+		int j, float z, float d_a)
+{
+	int q;
+	float alpha, beta, gamma;
+	float t, sech2;
+
+	q = n_prm > 1 ? j : 0;
+	alpha = prm[q];
+	beta = prm[n_prm + q];
+	gamma = prm[2 * n_prm + q];
+	t = dnn_tanh(beta * z);
+	sech2 = 1 - t * t;
+
+	d_prm[q] += d_a * gamma * z;
+	d_prm[n_prm + q] += d_a * gamma * z * z * sech2;
+	d_prm[2 * n_prm + q] += d_a * z * (alpha + t);
+
+	return d_a * gamma * (alpha + t + beta * z * sech2);
+}
+
 /* activation functions */
 float dnn_act_sigmoid(float x);
 float dnn_act_swish(float x);
 float dnn_d_act_swish(float x);
+float dnn_act_aptx(float x);
+float dnn_d_act_aptx(float x);
 float dnn_d_cost_mse(float out, float want);
 
 /* dnn_type creation */
@@ -64,15 +238,31 @@ struct dnn_train *dnn_create_train(struct dnn_net *net);
 
 /* set internal function pointers */
 int dnn_set_act_func(struct dnn_net *net, int lay_num, float (*actv_func)(float x));
+int dnn_set_output(struct dnn_net *net, int out_mode);
+int dnn_set_act_aptx(struct dnn_net *net, int lay_num, int per_neuron);
 int dnn_set_d_act_func(struct dnn_train *train, int lay_num,
 		float (*d_actv_func)(float x));
 int dnn_set_d_cost_func(struct dnn_train *train,
 		float (*d_cost_func)(float out, float want));
+int dnn_set_train_precision(struct dnn_train *train, int precision, float loss_scale);
+
+/* activations of a whole layer */
+void dnn_softmax(const float *z, float *p, int n);
+void dnn_aptx_forward(const float *prm, int n_prm, const float *z, float *a, int n);
+void dnn_activate(struct dnn_net *net, int lay, const float *z, float *a);
+
+/* buffer placement, see danknn_mem.c */
+void *dnn_alloc_buf(size_t size);
+void dnn_free_buf(void *buf);
+void dnn_pin_thread(int idx);
+int dnn_set_placement(int flags);
 
 /* network initialization */
 float normal_probability(float x);
 float *xavier_data(int n_cols, int n_rows);
 int dnn_init_net(struct dnn_net *net);
+void dnn_pack_layer(struct dnn_net *net, int lay);
+int dnn_repack_net(struct dnn_net *net);
 
 /* network save/load */
 int dnn_save_net(struct dnn_net *net, const char *filename);
@@ -85,9 +275,93 @@ int dnn_apply(struct dnn_train **train, int n_train, float train_aggr);
 float *get_input_gradient(struct dnn_train *train);
 
 float *dnn_test(struct dnn_net *net, float *inp);
+struct dnn_eval *dnn_evaluate(struct dnn_net *net, float **inputs, int *labels,
+		int n, int metric, int threads);
+float *dnn_forward_batch(struct dnn_net *net, float **inp, int n_b,
+		float *act_in, float *act_out);
+
+/* asynchronous inference */
+struct dnn_executor *dnn_create_executor(int threads, int max_batch);
+struct dnn_future *dnn_submit(struct dnn_executor *ex, struct dnn_net *net,
+		const float *inp);
+int dnn_poll(struct dnn_future *f);
+int dnn_future_on_done(struct dnn_future *f, void (*cb)(void *arg), void *arg);
+float *dnn_wait(struct dnn_future *f);
+int dnn_destroy_executor(struct dnn_executor *ex);
+
+/* intra-op parallel forward passes, see danknn_intra.c, dnn_intra_get()
+ * returns NULL if there is no group or it is busy, which
+ * dnn_intra_matvec() takes to mean the whole layer on this thread */
+struct intra_group;
+int dnn_set_intra_threads(int threads);
+struct intra_group *dnn_intra_get(void);
+void dnn_intra_put(struct intra_group *g);
+void dnn_intra_matvec(struct intra_group *g, struct dnn_net *net, int lay,
+		const float *x, float *out);
+
+/* hot-swappable models */
+struct dnn_model_handle *dnn_create_model_handle(struct dnn_net *net, int max_readers);
+struct dnn_net *dnn_model_acquire(struct dnn_model_handle *h);
+int dnn_model_release(struct dnn_model_handle *h, struct dnn_net *net);
+float *dnn_model_test(struct dnn_model_handle *h, float *inp);
+int dnn_model_swap(struct dnn_model_handle *h, struct dnn_net *net);
+int dnn_model_reload(struct dnn_model_handle *h, const char *filename);
+int dnn_model_reload_status(struct dnn_model_handle *h);
+int dnn_destroy_model_handle(struct dnn_model_handle *h);
+
+/* model stores */
+struct dnn_model_store *dnn_create_model_store(const char *dir, long budget);
+struct dnn_net *dnn_store_get(struct dnn_model_store *s, const char *name);
+int dnn_store_release(struct dnn_model_store *s, struct dnn_net *net);
+float *dnn_store_test(struct dnn_model_store *s, const char *name, float *inp);
+long dnn_store_resident(struct dnn_model_store *s);
+int dnn_destroy_model_store(struct dnn_model_store *s);
+
+/* incremental evaluation */
+struct dnn_incremental *dnn_create_incremental(struct dnn_net *net, float *inp);
+float *dnn_inc_update(struct dnn_incremental *inc, int n, const int *idx,
+		const float *vals);
+float *dnn_inc_reset(struct dnn_incremental *inc, float *inp);
+int dnn_destroy_incremental(struct dnn_incremental *inc);
+
+/* low rank layers */
+int dnn_compress_lowrank(struct dnn_net *net, int lay_num, int rank, float energy);
+int dnn_lowrank_alloc(struct dnn_net *net, int lay, int rank);
+int dnn_net_has_lowrank(struct dnn_net *net);
+
+/* populations */
+struct dnn_population *dnn_create_population(struct dnn_net *net, int n_memb);
+int dnn_init_population(struct dnn_population *pop);
+int dnn_pop_set_rate(struct dnn_population *pop, int memb, float rate);
+int dnn_pop_set_d_act_func(struct dnn_population *pop, int lay_num,
+		float (*d_actv_func)(float x));
+int dnn_pop_set_d_cost_func(struct dnn_population *pop,
+		float (*d_cost_func)(float out, float want));
+int dnn_pop_train(struct dnn_population *pop, float *inp, float *want);
+int dnn_pop_apply(struct dnn_population *pop, float train_aggr);
+float *dnn_pop_test(struct dnn_population *pop, float *inp);
+int dnn_pop_import(struct dnn_population *pop, int memb, struct dnn_net *net);
+struct dnn_net *dnn_pop_export(struct dnn_population *pop, int memb);
+int dnn_destroy_population(struct dnn_population *pop);
+
+/* kernel autotuning */
+int dnn_autotune(struct dnn_net *net);
+int dnn_apply_tuning(struct dnn_net *net);
 
 /* cleanup functions */
 int dnn_destroy_net(struct dnn_net *net);
 int dnn_destroy_train(struct dnn_train *train);
+int dnn_destroy_eval(struct dnn_eval *eval);
+
+/* multi-process data-parallel training */
+struct dnn_dist *dnn_dist_create(struct dnn_net *net, int rank, int world_size,
+		const char *next_host, int base_port);
+int dnn_dist_attach(struct dnn_dist *dist, struct dnn_train *train);
+int dnn_dist_bcast_net(struct dnn_dist *dist);
+int dnn_dist_apply(struct dnn_dist *dist, float train_aggr);
+int dnn_dist_rank(struct dnn_dist *dist);
+int dnn_dist_world_size(struct dnn_dist *dist);
+int dnn_dist_destroy(struct dnn_dist *dist);
+void dnn_dist_layer_done(struct dnn_dist *dist, int lay);
 
 #endif /* DNN_INTERN */
@@ -0,0 +1,277 @@
+/* sam's Dank Neural Network library (libdanknn)
+ *
+ * Copyright Sam Popham 2020
+ *
+ * this file is part of libdanknn
+ *
+ *  libdanknn is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* intra-op parallel forward passes
+ *
+ * one process wide group of workers splits the output rows of a single
+ * layer with the thread running the pass, a layer is started by bumping
+ * a generation counter and finished when every worker has bumped the done
+ * counter, both spun on, so a layer costs no system calls
+ * workers that see no layer for a while go to sleep on a condition
+ * variable instead of spinning an idle cpu forever */
+
+#include <stdlib.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "danknn_intern.h"
+
+/* smallest layer, in multiply-adds, worth splitting and the least each
+ * part of a split layer gets, below these the synchronization costs more
+ * than it saves */
+#define INTRA_MIN_WORK	(1 << 15)
+#define INTRA_MIN_PART	(1 << 13)
+/* parts start on a multiple of this many rows, as the kernels do rows in
+ * fours and eights */
+#define INTRA_ROW_ALIGN	8
+/* polls before a worker goes to sleep or a waiting pass starts yielding */
+#define INTRA_SPIN	(1 << 16)
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax()	__builtin_ia32_pause()
+#else
+#define cpu_relax()	__asm__ __volatile__("" ::: "memory")
+#endif
+
+struct intra_group{
+	int n_workers;	/* not counting the thread running the pass */
+	pthread_t *thread;
+
+	/* the layer being split, written before gen is bumped */
+	struct dnn_net *net;
+	int lay;
+	int n_parts;
+	const float *x;
+	float *out;
+
+	unsigned gen;
+	int n_done;
+	int shutdown;
+
+	/* for sleeping workers */
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	int n_asleep;
+
+	/* held by the pass using the group */
+	pthread_mutex_t busy;
+};
+
+struct intra_worker{
+	struct intra_group *g;
+	int idx;
+};
+
+static struct intra_group *intra;
+
+/* rows of part p of n_parts of an n_rows layer */
+static void intra_part(int n_rows, int n_parts, int p, int *j0, int *j1)
+{
+	int per;
+
+	per = (n_rows + n_parts - 1) / n_parts;
+	per = (per + INTRA_ROW_ALIGN - 1) / INTRA_ROW_ALIGN * INTRA_ROW_ALIGN;
+	*j0 = p * per < n_rows ? p * per : n_rows;
+	*j1 = *j0 + per < n_rows ? *j0 + per : n_rows;
+}
+
+static void intra_run(struct intra_group *g, int p)
+{
+	int j0, j1;
+
+	if(p >= g->n_parts)
+		return;
+	intra_part(g->net->lay_sizes[g->lay + 1], g->n_parts, p, &j0, &j1);
+	if(j0 < j1)
+		dnn_lay_matvec(g->net, g->lay, j0, j1, g->x, g->out);
+}
+
+static void *intra_thread(void *arg)
+{
+	int i;
+	unsigned seen;
+	struct intra_worker *w = arg;
+	struct intra_group *g = w->g;
+	int idx = w->idx;
+
+	free(w);
+	dnn_pin_thread(idx);
+
+	/* not read from gen, a layer may already have been started */
+	seen = 0;
+	for(;;){
+		for(i = 0; i < INTRA_SPIN; ++i){
+			if(__atomic_load_n(&g->gen, __ATOMIC_ACQUIRE) != seen)
+				break;
+			cpu_relax();
+		}
+		if(i == INTRA_SPIN){
+			pthread_mutex_lock(&g->lock);
+			__atomic_add_fetch(&g->n_asleep, 1, __ATOMIC_SEQ_CST);
+			while(__atomic_load_n(&g->gen, __ATOMIC_SEQ_CST) == seen &&
+					!g->shutdown)
+				pthread_cond_wait(&g->wake, &g->lock);
+			__atomic_sub_fetch(&g->n_asleep, 1, __ATOMIC_SEQ_CST);
+			pthread_mutex_unlock(&g->lock);
+		}
+		if(__atomic_load_n(&g->shutdown, __ATOMIC_ACQUIRE))
+			break;
+
+		seen = __atomic_load_n(&g->gen, __ATOMIC_ACQUIRE);
+		intra_run(g, idx);
+		__atomic_add_fetch(&g->n_done, 1, __ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+
+static void intra_stop(struct intra_group *g)
+{
+	int i;
+
+	pthread_mutex_lock(&g->lock);
+	__atomic_store_n(&g->shutdown, 1, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&g->gen, 1, __ATOMIC_SEQ_CST);
+	pthread_cond_broadcast(&g->wake);
+	pthread_mutex_unlock(&g->lock);
+
+	for(i = 0; i < g->n_workers; ++i)
+		pthread_join(g->thread[i], NULL);
+
+	pthread_mutex_destroy(&g->lock);
+	pthread_cond_destroy(&g->wake);
+	pthread_mutex_destroy(&g->busy);
+	free(g->thread);
+	free(g);
+}
+
+int dnn_set_intra_threads(int threads)
+{
+	int i;
+	struct intra_worker *w;
+	struct intra_group *g;
+
+	if(threads < 0)
+		return -1;
+
+	if(intra){
+		intra_stop(intra);
+		intra = NULL;
+	}
+	if(threads < 2)
+		return 0;
+
+	g = calloc(1, sizeof *g);
+	if(!g)
+		return -1;
+	g->thread = malloc(sizeof *g->thread * (threads - 1));
+	if(!g->thread){
+		free(g);
+		return -1;
+	}
+	pthread_mutex_init(&g->lock, NULL);
+	pthread_cond_init(&g->wake, NULL);
+	pthread_mutex_init(&g->busy, NULL);
+
+	/* worker i runs part i + 1, the calling thread part 0 */
+	for(i = 0; i < threads - 1; ++i){
+		w = malloc(sizeof *w);
+		if(!w)
+			break;
+		w->g = g;
+		w->idx = i + 1;
+		if(pthread_create(&g->thread[i], NULL, intra_thread, w)){
+			free(w);
+			break;
+		}
+	}
+	g->n_workers = i;
+
+	if(!g->n_workers){
+		intra_stop(g);
+		return -1;
+	}
+	intra = g;
+
+	return 0;
+}
+
+struct intra_group *dnn_intra_get(void)
+{
+	struct intra_group *g = intra;
+
+	if(!g || pthread_mutex_trylock(&g->busy))
+		return NULL;
+	return g;
+}
+
+void dnn_intra_put(struct intra_group *g)
+{
+	if(g)
+		pthread_mutex_unlock(&g->busy);
+}
+
+void dnn_intra_matvec(struct intra_group *g, struct dnn_net *net, int lay,
+		const float *x, float *out)
+{
+	int i;
+	int n_parts;
+	long work;
+
+	work = (long)net->lay_sizes[lay] * net->lay_sizes[lay + 1];
+	n_parts = 0;
+	/* factored layers would redo the rank intermediate in every part */
+	if(g && !net->lays[lay].rank && work >= INTRA_MIN_WORK){
+		n_parts = work / INTRA_MIN_PART;
+		if(n_parts > g->n_workers + 1)
+			n_parts = g->n_workers + 1;
+		if(n_parts > net->lay_sizes[lay + 1] / INTRA_ROW_ALIGN)
+			n_parts = net->lay_sizes[lay + 1] / INTRA_ROW_ALIGN;
+	}
+	if(n_parts < 2){
+		dnn_lay_matvec(net, lay, 0, net->lay_sizes[lay + 1], x, out);
+		return;
+	}
+
+	g->net = net;
+	g->lay = lay;
+	g->n_parts = n_parts;
+	g->x = x;
+	g->out = out;
+	__atomic_store_n(&g->n_done, 0, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&g->gen, 1, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&g->n_asleep, __ATOMIC_SEQ_CST)){
+		pthread_mutex_lock(&g->lock);
+		pthread_cond_broadcast(&g->wake);
+		pthread_mutex_unlock(&g->lock);
+	}
+
+	intra_run(g, 0);
+
+	/* every worker checks in, even those without a part, so none is
+	 * still reading the job when the next layer overwrites it */
+	for(i = 0; __atomic_load_n(&g->n_done, __ATOMIC_ACQUIRE) < g->n_workers; ++i){
+		/* give the cpu up if the workers aren't getting one */
+		if(i < INTRA_SPIN)
+			cpu_relax();
+		else
+			sched_yield();
+	}
+}
@@ -0,0 +1,401 @@
+/* sam's Dank Neural Network library (libdanknn)
+ *
+ * Copyright Sam Popham 2020
+ *
+ * this file is part of libdanknn
+ *
+ *  libdanknn is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* low rank factoring of dense layers
+ *
+ * a layer's n_out * n_in weights W are replaced by lr_u (n_out * r) and
+ * lr_v (r * n_in) from a truncated svd, W ~= U S V^T with lr_u = U sqrt(S)
+ * and lr_v = sqrt(S) V^T, the svd is randomized (Halko, Martinsson and
+ * Tropp 2011): W is multiplied by a few more random vectors than the rank
+ * wanted, a couple of power iterations sharpen the range they span, and the
+ * small matrix B = Q^T W over an orthonormal basis Q of that range is
+ * decomposed exactly through the eigenvectors of B B^T */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "danknn_intern.h"
+
+/* extra random vectors beyond the rank asked for, and power iterations */
+#define LR_OVERSAMPLE	10
+#define LR_POWER_ITERS	2
+/* first sketch size when searching for the rank holding some energy */
+#define LR_FIRST_SKETCH	32
+#define LR_JACOBI_SWEEPS	60
+
+int dnn_net_has_lowrank(struct dnn_net *net)
+{
+	int i;
+
+	for(i = 0; i < net->num_lays - 1; ++i)
+		if(net->lays[i].rank)
+			return 1;
+	return 0;
+}
+
+/* swaps layer lay's weights for uninitialized rank rank factors, the
+ * layer is left alone if they can't be allocated */
+int dnn_lowrank_alloc(struct dnn_net *net, int lay, int rank)
+{
+	float *u, *v;
+	struct dnn_layer *l = &net->lays[lay];
+
+	/* dnn_lay_matvec() keeps the rank intermediate on the stack */
+	if(rank < 1 || rank > DNN_MAX_RANK)
+		return -1;
+
+	u = dnn_alloc_buf(sizeof *u * net->lay_sizes[lay + 1] * rank);
+	v = dnn_alloc_buf(sizeof *v * rank * net->lay_sizes[lay]);
+	if(!u || !v){
+		dnn_free_buf(u);
+		dnn_free_buf(v);
+		return -1;
+	}
+
+	free(l->wm);
+	dnn_free_buf(l->wm_alloc_handle);
+	dnn_free_buf(l->wm_t);
+	dnn_free_buf(l->lr_u);
+	dnn_free_buf(l->lr_v);
+	l->wm = NULL;
+	l->wm_alloc_handle = NULL;
+	l->wm_t = NULL;
+	l->lr_u = u;
+	l->lr_v = v;
+	l->rank = rank;
+	/* the rank intermediate would be recomputed for every block */
+	l->row_block = 0;
+
+	return 0;
+}
+
+/* orthonormalizes the n_col columns of length len in q (column c at
+ * q[c * len]) in place, Gram-Schmidt run twice, which is
+ * enough to keep them orthogonal, columns that vanish become zero */
+static void lr_orth(float *q, int n_col, int len)
+{
+	int a, b, i, pass;
+	double dot, norm, norm0;
+
+	for(a = 0; a < n_col; ++a){
+		norm0 = 0;
+		for(i = 0; i < len; ++i)
+			norm0 += (double)q[a * len + i] * q[a * len + i];
+		for(pass = 0; pass < 2; ++pass)
+			for(b = 0; b < a; ++b){
+				dot = 0;
+				for(i = 0; i < len; ++i)
+					dot += (double)q[a * len + i] * q[b * len + i];
+				for(i = 0; i < len; ++i)
+					q[a * len + i] -= dot * q[b * len + i];
+			}
+		norm = 0;
+		for(i = 0; i < len; ++i)
+			norm += (double)q[a * len + i] * q[a * len + i];
+		norm = sqrt(norm);
+		if(norm <= 1e-6 * sqrt(norm0) || norm == 0){
+			memset(&q[a * len], 0, sizeof *q * len);
+			continue;
+		}
+		for(i = 0; i < len; ++i)
+			q[a * len + i] /= norm;
+	}
+}
+
+/* eigenvalues lam[n] and eigenvectors (column c at e[c * n]) of the
+ * symmetric n * n matrix c, destroyed, by cyclic Jacobi rotations, sorted
+ * by decreasing eigenvalue */
+static void lr_eig(double *c, int n, double *lam, double *e)
+{
+	int p, q, i, sweep;
+	double off, diag, theta, t, cs, sn, cp, cq, tmp;
+
+	for(i = 0; i < n * n; ++i)
+		e[i] = 0;
+	for(i = 0; i < n; ++i)
+		e[i * n + i] = 1;
+
+	for(sweep = 0; sweep < LR_JACOBI_SWEEPS; ++sweep){
+		off = 0;
+		diag = 0;
+		for(p = 0; p < n; ++p){
+			diag += c[p * n + p] * c[p * n + p];
+			for(q = p + 1; q < n; ++q)
+				off += c[p * n + q] * c[p * n + q];
+		}
+		if(off <= 1e-24 * diag)
+			break;
+
+		for(p = 0; p < n; ++p)
+			for(q = p + 1; q < n; ++q){
+				if(fabs(c[p * n + q]) < 1e-30)
+					continue;
+				theta = (c[q * n + q] - c[p * n + p]) / (2 * c[p * n + q]);
+				t = (theta >= 0 ? 1 : -1) / (fabs(theta) + sqrt(theta * theta + 1));
+				cs = 1 / sqrt(t * t + 1);
+				sn = t * cs;
+				for(i = 0; i < n; ++i){
+					cp = c[i * n + p];
+					cq = c[i * n + q];
+					c[i * n + p] = cs * cp - sn * cq;
+					c[i * n + q] = sn * cp + cs * cq;
+				}
+				for(i = 0; i < n; ++i){
+					cp = c[p * n + i];
+					cq = c[q * n + i];
+					c[p * n + i] = cs * cp - sn * cq;
+					c[q * n + i] = sn * cp + cs * cq;
+				}
+				for(i = 0; i < n; ++i){
+					cp = e[p * n + i];
+					cq = e[q * n + i];
+					e[p * n + i] = cs * cp - sn * cq;
+					e[q * n + i] = sn * cp + cs * cq;
+				}
+			}
+	}
+
+	for(i = 0; i < n; ++i)
+		lam[i] = c[i * n + i];
+
+	/* selection sort, n is small */
+	for(p = 0; p < n; ++p){
+		q = p;
+		for(i = p + 1; i < n; ++i)
+			if(lam[i] > lam[q])
+				q = i;
+		if(q == p)
+			continue;
+		tmp = lam[p];
+		lam[p] = lam[q];
+		lam[q] = tmp;
+		for(i = 0; i < n; ++i){
+			tmp = e[p * n + i];
+			e[p * n + i] = e[q * n + i];
+			e[q * n + i] = tmp;
+		}
+	}
+}
+
+/* rank l randomized svd of the m * n row major w, leaves the left singular
+ * vectors in u (column c at u[c * m]), the squared singular values in
+ * lam and the rows of B^T E (unnormalized right singular vectors scaled
+ * by the singular values) in bte (row c at bte[c * n]) */
+static int lr_svd(const float *w, int m, int n, int l, float *u, double *lam,
+		float *bte)
+{
+	int i, j, k, c, it;
+	double sum;
+	float *y, *z, *b;
+	double *cm, *e;
+
+	y = malloc(sizeof *y * l * m);
+	z = malloc(sizeof *z * l * n);
+	b = malloc(sizeof *b * l * n);
+	cm = malloc(sizeof *cm * l * l);
+	e = malloc(sizeof *e * l * l);
+	if(!y || !z || !b || !cm || !e){
+		free(y);
+		free(z);
+		free(b);
+		free(cm);
+		free(e);
+		return -1;
+	}
+
+	/* random test vectors */
+	for(i = 0; i < l * n; ++i)
+		z[i] = 2 * (rand() / (float)RAND_MAX) - 1;
+
+	for(it = 0; ; ++it){
+		/* y = w z */
+		for(c = 0; c < l; ++c)
+			for(j = 0; j < m; ++j){
+				sum = 0;
+				for(k = 0; k < n; ++k)
+					sum += w[j * n + k] * z[c * n + k];
+				y[c * m + j] = sum;
+			}
+		lr_orth(y, l, m);
+		if(it == LR_POWER_ITERS)
+			break;
+		/* z = w^T y */
+		for(c = 0; c < l; ++c){
+			memset(&z[c * n], 0, sizeof *z * n);
+			for(j = 0; j < m; ++j)
+				for(k = 0; k < n; ++k)
+					z[c * n + k] += w[j * n + k] * y[c * m + j];
+		}
+		lr_orth(z, l, n);
+	}
+
+	/* b = y^T w, l * n */
+	for(c = 0; c < l; ++c){
+		memset(&b[c * n], 0, sizeof *b * n);
+		for(j = 0; j < m; ++j)
+			for(k = 0; k < n; ++k)
+				b[c * n + k] += y[c * m + j] * w[j * n + k];
+	}
+
+	/* b b^T = E diag(lam) E^T */
+	for(i = 0; i < l; ++i)
+		for(c = i; c < l; ++c){
+			sum = 0;
+			for(k = 0; k < n; ++k)
+				sum += (double)b[i * n + k] * b[c * n + k];
+			cm[i * l + c] = cm[c * l + i] = sum;
+		}
+	lr_eig(cm, l, lam, e);
+
+	/* u = y E, bte = E^T b */
+	for(c = 0; c < l; ++c){
+		for(j = 0; j < m; ++j){
+			sum = 0;
+			for(i = 0; i < l; ++i)
+				sum += e[c * l + i] * y[i * m + j];
+			u[c * m + j] = sum;
+		}
+		for(k = 0; k < n; ++k){
+			sum = 0;
+			for(i = 0; i < l; ++i)
+				sum += e[c * l + i] * b[i * n + k];
+			bte[c * n + k] = sum;
+		}
+	}
+
+	free(y);
+	free(z);
+	free(b);
+	free(cm);
+	free(e);
+
+	return 0;
+}
+
+int dnn_compress_lowrank(struct dnn_net *net, int lay_num, int rank, float energy)
+{
+	int i, j, k, c;
+	int m, n, l, l_max, r;
+	int lay;
+	int own_w;
+	double total, kept, s;
+	float *w, *u, *bte;
+	double *lam;
+	struct dnn_layer *dl;
+
+	if(!net || lay_num <= 0 || lay_num >= net->num_lays)
+		return -1;
+	if(rank < 0 || rank > DNN_MAX_RANK || (rank == 0 && (energy <= 0 || energy > 1)))
+		return -1;
+	/* a dnn_dist context's buckets and updates address the dense weights */
+	if(__atomic_load_n(&net->n_dist, __ATOMIC_SEQ_CST))
+		return -1;
+
+	lay = lay_num - 1;
+	dl = &net->lays[lay];
+	m = net->lay_sizes[lay_num];
+	n = net->lay_sizes[lay];
+	l_max = m < n ? m : n;
+
+	/* an already factored layer is refactored from its product */
+	own_w = dl->rank != 0;
+	if(own_w){
+		w = malloc(sizeof *w * m * n);
+		if(!w)
+			return -1;
+		for(j = 0; j < m; ++j)
+			for(k = 0; k < n; ++k){
+				s = 0;
+				for(c = 0; c < dl->rank; ++c)
+					s += dl->lr_u[j * dl->rank + c] * dl->lr_v[c * n + k];
+				w[j * n + k] = s;
+			}
+	}else{
+		w = dl->wm_alloc_handle;
+	}
+
+	total = 0;
+	for(i = 0; i < m * n; ++i)
+		total += (double)w[i] * w[i];
+
+	u = malloc(sizeof *u * l_max * m);
+	bte = malloc(sizeof *bte * l_max * n);
+	lam = malloc(sizeof *lam * l_max);
+	if(!u || !bte || !lam)
+		goto fail;
+
+	if(rank){
+		l = rank + LR_OVERSAMPLE < l_max ? rank + LR_OVERSAMPLE : l_max;
+		if(lr_svd(w, m, n, l, u, lam, bte))
+			goto fail;
+		r = rank < l ? rank : l;
+	}else{
+		/* grow the sketch until it holds the energy asked for */
+		l = LR_FIRST_SKETCH < l_max ? LR_FIRST_SKETCH : l_max;
+		for(;;){
+			if(lr_svd(w, m, n, l, u, lam, bte))
+				goto fail;
+			kept = 0;
+			for(r = 0; r < l && kept < energy * total; ++r)
+				kept += lam[r] > 0 ? lam[r] : 0;
+			if(kept >= energy * total || l == l_max)
+				break;
+			l = 2 * l < l_max ? 2 * l : l_max;
+		}
+		if(r < 1)
+			r = 1;
+	}
+
+	/* factoring has to actually make the layer smaller */
+	if((long)r * (m + n) >= (long)m * n || r > DNN_MAX_RANK)
+		goto fail;
+
+	/* frees the dense weights, w is done with by now */
+	if(!own_w)
+		w = NULL;
+	if(dnn_lowrank_alloc(net, lay, r))
+		goto fail;
+
+	for(c = 0; c < r; ++c){
+		s = sqrt(sqrt(lam[c] > 0 ? lam[c] : 0));
+		for(j = 0; j < m; ++j)
+			dl->lr_u[j * r + c] = u[c * m + j] * s;
+		for(k = 0; k < n; ++k)
+			dl->lr_v[c * n + k] = s > 0 ? bte[c * n + k] / s : 0;
+	}
+
+	if(own_w)
+		free(w);
+	free(u);
+	free(bte);
+	free(lam);
+
+	return r;
+
+fail:
+	if(own_w)
+		free(w);
+	free(u);
+	free(bte);
+	free(lam);
+
+	return -1;
+}
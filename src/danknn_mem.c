@@ -0,0 +1,247 @@
+/* sam's Dank Neural Network library (libdanknn)
+ *
+ * Copyright Sam Popham 2020
+ *
+ * this file is part of libdanknn
+ *
+ *  libdanknn is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* placement of the big weight and gradient buffers
+ *
+ * by default they come from malloc() and land on whichever numa node first
+ * touches them, dnn_set_placement() can have them mapped directly instead,
+ * backed by huge pages and/or interleaved page by page across every node,
+ * anything the host doesn't support quietly falls back to the next best */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "danknn_intern.h"
+
+/* buffers smaller than this aren't worth a mapping of their own */
+#define MEM_MAP_MIN	(64 * 1024)
+#define MEM_HUGE_SIZE	(2 * 1024 * 1024)
+
+/* bytes in front of every buffer recording how to free it, a cache line
+ * so the buffer itself stays 64 byte aligned in a mapping */
+#define MEM_HEADER	64
+
+#define MEM_MALLOC	0
+#define MEM_MAPPED	1
+
+/* from linux/mempolicy.h */
+#define MEM_MPOL_INTERLEAVE	3
+#define MEM_MAX_NODES	1024
+
+struct mem_header{
+	size_t map_len;
+	int kind;
+};
+
+static int placement;
+
+int dnn_set_placement(int flags)
+{
+	if(flags & ~(DNN_PLACE_HUGEPAGES | DNN_PLACE_HUGETLB |
+				DNN_PLACE_INTERLEAVE | DNN_PLACE_PIN_THREADS))
+		return -1;
+
+	placement = flags;
+
+	return 0;
+}
+
+/* mask of the online nodes from sysfs, e.g. "0-1" or "0,2-3", returns the
+ * number of nodes in it */
+static int mem_online_nodes(unsigned long *mask, int max_nodes)
+{
+	int lo, hi, i;
+	int n;
+	char buf[256];
+	char *p;
+	FILE *fp;
+
+	memset(mask, 0, max_nodes / 8);
+
+	fp = fopen("/sys/devices/system/node/online", "r");
+	if(!fp)
+		return 0;
+	if(!fgets(buf, sizeof buf, fp)){
+		fclose(fp);
+		return 0;
+	}
+	fclose(fp);
+
+	n = 0;
+	for(p = buf; *p && *p != '\n';){
+		lo = strtol(p, &p, 10);
+		hi = lo;
+		if(*p == '-')
+			hi = strtol(p + 1, &p, 10);
+		for(i = lo; i <= hi && i < max_nodes; ++i){
+			mask[i / (8 * sizeof *mask)] |= 1UL << (i % (8 * sizeof *mask));
+			++n;
+		}
+		if(*p == ',')
+			++p;
+		else
+			break;
+	}
+
+	return n;
+}
+
+/* maps len bytes according to placement, NULL if nothing better than
+ * malloc() could be had */
+static void *mem_map(size_t *len)
+{
+	size_t want;
+	size_t head;
+	char *p, *aligned;
+	unsigned long nodes[MEM_MAX_NODES / (8 * sizeof(unsigned long))];
+
+	p = MAP_FAILED;
+	want = *len;
+
+#ifdef MAP_HUGETLB
+	if(placement & DNN_PLACE_HUGETLB){
+		/* explicit huge pages, only there if the admin reserved some */
+		*len = (want + MEM_HUGE_SIZE - 1) / MEM_HUGE_SIZE * MEM_HUGE_SIZE;
+		p = mmap(NULL, *len, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	}
+#endif
+
+	if(p == MAP_FAILED && (placement & (DNN_PLACE_HUGEPAGES | DNN_PLACE_HUGETLB))){
+		/* transparent huge pages want a huge page aligned range, map
+		 * one huge page too many and trim the ends */
+		*len = (want + MEM_HUGE_SIZE - 1) / MEM_HUGE_SIZE * MEM_HUGE_SIZE;
+		p = mmap(NULL, *len + MEM_HUGE_SIZE, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(p != MAP_FAILED){
+			aligned = (char *)(((unsigned long)p + MEM_HUGE_SIZE - 1) &
+					~(unsigned long)(MEM_HUGE_SIZE - 1));
+			head = aligned - p;
+			if(head)
+				munmap(p, head);
+			munmap(aligned + *len, MEM_HUGE_SIZE - head);
+			p = aligned;
+#ifdef MADV_HUGEPAGE
+			madvise(p, *len, MADV_HUGEPAGE);
+#endif
+		}
+	}
+
+	if(p == MAP_FAILED && (placement & DNN_PLACE_INTERLEAVE)){
+		*len = want;
+		p = mmap(NULL, *len, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	}
+
+	if(p == MAP_FAILED)
+		return NULL;
+
+#ifdef SYS_mbind
+	/* before anything touches the pages, so the policy decides where
+	 * each of them goes */
+	if((placement & DNN_PLACE_INTERLEAVE) &&
+			mem_online_nodes(nodes, MEM_MAX_NODES) > 1)
+		syscall(SYS_mbind, p, *len, MEM_MPOL_INTERLEAVE, nodes,
+				(unsigned long)MEM_MAX_NODES, 0);
+#else
+	(void)nodes;
+#endif
+
+	return p;
+}
+
+void *dnn_alloc_buf(size_t size)
+{
+	size_t len;
+	char *p;
+	struct mem_header *hdr;
+
+	p = NULL;
+	len = size + MEM_HEADER;
+	if(placement & (DNN_PLACE_HUGEPAGES | DNN_PLACE_HUGETLB | DNN_PLACE_INTERLEAVE) &&
+			len >= MEM_MAP_MIN)
+		p = mem_map(&len);
+
+	if(p){
+		hdr = (struct mem_header *)p;
+		hdr->kind = MEM_MAPPED;
+		hdr->map_len = len;
+	}else{
+		p = malloc(size + MEM_HEADER);
+		if(!p)
+			return NULL;
+		hdr = (struct mem_header *)p;
+		hdr->kind = MEM_MALLOC;
+		hdr->map_len = 0;
+	}
+
+	return p + MEM_HEADER;
+}
+
+void dnn_free_buf(void *buf)
+{
+	struct mem_header *hdr;
+
+	if(!buf)
+		return;
+
+	hdr = (struct mem_header *)((char *)buf - MEM_HEADER);
+	if(hdr->kind == MEM_MAPPED)
+		munmap(hdr, hdr->map_len);
+	else
+		free(hdr);
+}
+
+/* pins the calling worker thread, the idx'th of its group, to one of the
+ * cpus this process may run on when DNN_PLACE_PIN_THREADS is set, so it
+ * keeps its caches and stays on the node its pages were placed on */
+void dnn_pin_thread(int idx)
+{
+	int i, n;
+	cpu_set_t allowed, one;
+
+	if(!(placement & DNN_PLACE_PIN_THREADS))
+		return;
+	if(sched_getaffinity(0, sizeof allowed, &allowed))
+		return;
+
+	n = CPU_COUNT(&allowed);
+	if(n < 1)
+		return;
+	idx %= n;
+
+	for(i = 0; i < CPU_SETSIZE; ++i){
+		if(!CPU_ISSET(i, &allowed))
+			continue;
+		if(idx-- == 0)
+			break;
+	}
+
+	CPU_ZERO(&one);
+	CPU_SET(i, &one);
+	pthread_setaffinity_np(pthread_self(), sizeof one, &one);
+}
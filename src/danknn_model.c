@@ -0,0 +1,269 @@
+/* sam's Dank Neural Network library (libdanknn)
+ *
+ * Copyright Sam Popham 2020
+ *
+ * this file is part of libdanknn
+ *
+ *  libdanknn is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* hot-swappable model handles
+ *
+ * readers never lock, each one owns a hazard slot for as long as it uses
+ * the current net: it claims a free slot, writes the net it read into it,
+ * then reads the current net again and retries if it changed, so once
+ * the read matches the writer is guaranteed to see the slot
+ * a swap exchanges the current net for the new one, then waits for no
+ * slot to hold the old one before destroying it */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "danknn_intern.h"
+
+#define RELOAD_IDLE	0
+#define RELOAD_RUNNING	1
+
+/* held by a slot between being claimed and being given a net */
+static char slot_claimed;
+#define SLOT_CLAIMED	((struct dnn_net *)&slot_claimed)
+
+struct dnn_model_handle{
+	struct dnn_net *cur;
+	struct dnn_net **slot;
+	int n_slots;
+
+	/* one swap at a time */
+	pthread_mutex_t swap_lock;
+
+	/* background reload, reload_started says reload_thread is to be
+	 * joined, reload_ret is the last reload's result */
+	pthread_mutex_t reload_lock;
+	pthread_t reload_thread;
+	int reload_started;
+	int reload_state;
+	int reload_ret;
+	char *reload_file;
+};
+
+struct dnn_model_handle *dnn_create_model_handle(struct dnn_net *net, int max_readers)
+{
+	struct dnn_model_handle *h;
+
+	if(!net || max_readers < 1)
+		return NULL;
+
+	h = calloc(1, sizeof *h);
+	if(!h)
+		return NULL;
+	h->slot = calloc(max_readers, sizeof *h->slot);
+	if(!h->slot){
+		free(h);
+		return NULL;
+	}
+	h->n_slots = max_readers;
+	h->cur = net;
+	pthread_mutex_init(&h->swap_lock, NULL);
+	pthread_mutex_init(&h->reload_lock, NULL);
+
+	return h;
+}
+
+struct dnn_net *dnn_model_acquire(struct dnn_model_handle *h)
+{
+	int i;
+	struct dnn_net *net, *want;
+	struct dnn_net **slot;
+
+	if(!h)
+		return NULL;
+
+	/* claim a slot, waiting for one if all are in use */
+	slot = NULL;
+	while(!slot){
+		for(i = 0; i < h->n_slots; ++i){
+			want = NULL;
+			if(__atomic_compare_exchange_n(&h->slot[i], &want, SLOT_CLAIMED,
+						0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)){
+				slot = &h->slot[i];
+				break;
+			}
+		}
+		if(!slot)
+			sched_yield();
+	}
+
+	/* publish, then make sure it was still current once published */
+	net = __atomic_load_n(&h->cur, __ATOMIC_SEQ_CST);
+	for(;;){
+		__atomic_store_n(slot, net, __ATOMIC_SEQ_CST);
+		want = __atomic_load_n(&h->cur, __ATOMIC_SEQ_CST);
+		if(want == net)
+			break;
+		net = want;
+	}
+
+	return net;
+}
+
+int dnn_model_release(struct dnn_model_handle *h, struct dnn_net *net)
+{
+	int i;
+	struct dnn_net *want;
+
+	if(!h || !net)
+		return -1;
+
+	/* any slot holding net will do, it is the count that matters */
+	for(i = 0; i < h->n_slots; ++i){
+		want = net;
+		if(__atomic_compare_exchange_n(&h->slot[i], &want, NULL,
+					0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+			return 0;
+	}
+
+	return -1;
+}
+
+float *dnn_model_test(struct dnn_model_handle *h, float *inp)
+{
+	float *output;
+	struct dnn_net *net;
+
+	net = dnn_model_acquire(h);
+	if(!net)
+		return NULL;
+	output = dnn_test(net, inp);
+	dnn_model_release(h, net);
+
+	return output;
+}
+
+/* whether any reader still holds net */
+static int model_in_use(struct dnn_model_handle *h, struct dnn_net *net)
+{
+	int i;
+
+	for(i = 0; i < h->n_slots; ++i)
+		if(__atomic_load_n(&h->slot[i], __ATOMIC_SEQ_CST) == net)
+			return 1;
+	return 0;
+}
+
+int dnn_model_swap(struct dnn_model_handle *h, struct dnn_net *net)
+{
+	struct dnn_net *old;
+
+	if(!h || !net)
+		return -1;
+
+	pthread_mutex_lock(&h->swap_lock);
+	old = __atomic_exchange_n(&h->cur, net, __ATOMIC_SEQ_CST);
+
+	/* readers that got old finish their pass, new ones get net */
+	if(old != net){
+		while(model_in_use(h, old))
+			sched_yield();
+		dnn_destroy_net(old);
+	}
+	pthread_mutex_unlock(&h->swap_lock);
+
+	return 0;
+}
+
+static void *reload_thread(void *arg)
+{
+	int ret;
+	struct dnn_net *net;
+	struct dnn_model_handle *h = arg;
+
+	ret = -1;
+	net = dnn_load_net(h->reload_file);
+	if(net)
+		ret = dnn_model_swap(h, net);
+
+	__atomic_store_n(&h->reload_ret, ret, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&h->reload_state, RELOAD_IDLE, __ATOMIC_SEQ_CST);
+
+	return NULL;
+}
+
+int dnn_model_reload(struct dnn_model_handle *h, const char *filename)
+{
+	char *file;
+
+	if(!h || !filename)
+		return -1;
+
+	pthread_mutex_lock(&h->reload_lock);
+	if(__atomic_load_n(&h->reload_state, __ATOMIC_SEQ_CST) == RELOAD_RUNNING){
+		pthread_mutex_unlock(&h->reload_lock);
+		return -1;
+	}
+	if(h->reload_started){
+		pthread_join(h->reload_thread, NULL);
+		h->reload_started = 0;
+	}
+
+	file = strdup(filename);
+	if(!file){
+		pthread_mutex_unlock(&h->reload_lock);
+		return -1;
+	}
+	free(h->reload_file);
+	h->reload_file = file;
+
+	__atomic_store_n(&h->reload_state, RELOAD_RUNNING, __ATOMIC_SEQ_CST);
+	if(pthread_create(&h->reload_thread, NULL, reload_thread, h)){
+		__atomic_store_n(&h->reload_state, RELOAD_IDLE, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&h->reload_lock);
+		return -1;
+	}
+	h->reload_started = 1;
+	pthread_mutex_unlock(&h->reload_lock);
+
+	return 0;
+}
+
+int dnn_model_reload_status(struct dnn_model_handle *h)
+{
+	if(!h)
+		return -1;
+
+	if(__atomic_load_n(&h->reload_state, __ATOMIC_SEQ_CST) == RELOAD_RUNNING)
+		return 1;
+	return __atomic_load_n(&h->reload_ret, __ATOMIC_SEQ_CST);
+}
+
+int dnn_destroy_model_handle(struct dnn_model_handle *h)
+{
+	if(!h)
+		return -1;
+
+	pthread_mutex_lock(&h->reload_lock);
+	if(h->reload_started)
+		pthread_join(h->reload_thread, NULL);
+	pthread_mutex_unlock(&h->reload_lock);
+
+	dnn_destroy_net(h->cur);
+	pthread_mutex_destroy(&h->swap_lock);
+	pthread_mutex_destroy(&h->reload_lock);
+	free(h->reload_file);
+	free(h->slot);
+	free(h);
+
+	return 0;
+}
@@ -0,0 +1,476 @@
+/* sam's Dank Neural Network library (libdanknn)
+ *
+ * Copyright Sam Popham 2020
+ *
+ * this file is part of libdanknn
+ *
+ *  libdanknn is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* populations of same-shape networks
+ *
+ * every parameter is stored member-innermost, weight k of row j of layer i
+ * for member m at lays[i].w[(j * n_in + k) * n_memb + m], and so is every
+ * activation and gradient, so the forward pass, the backward pass and the
+ * update each become loops over the members with unit stride, which the
+ * compiler vectorizes however small the layers are */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "danknn_intern.h"
+
+struct pop_layer{
+	float *w;	/* n_out * n_in * n_memb */
+	float *b;	/* n_out * n_memb */
+	float *d_w;
+	float *d_b;
+	float (*actv_func)(float x);
+	float (*d_actv_func)(float x);
+
+	/* n_out * n_memb each, of the last dnn_pop_train() */
+	float *wtd_sum;
+	float *act;
+	float *d_wtd_sum;
+	float *d_act;
+};
+
+struct dnn_population{
+	int n_memb;
+	int num_lays;
+	int *lay_sizes;
+	int out_mode;
+	float (*d_cost)(float out, float want);
+
+	struct pop_layer *lays;	/* num_lays - 1 of them */
+	float *rate;		/* n_memb learning rate multipliers */
+	int n_acc;		/* examples accumulated since the last apply */
+};
+
+int dnn_destroy_population(struct dnn_population *pop)
+{
+	int i;
+
+	if(!pop)
+		return -1;
+
+	if(pop->lays){
+		for(i = 0; i < pop->num_lays - 1; ++i){
+			dnn_free_buf(pop->lays[i].w);
+			dnn_free_buf(pop->lays[i].d_w);
+			free(pop->lays[i].b);
+			free(pop->lays[i].d_b);
+			free(pop->lays[i].wtd_sum);
+			free(pop->lays[i].act);
+			free(pop->lays[i].d_wtd_sum);
+			free(pop->lays[i].d_act);
+		}
+	}
+	free(pop->lays);
+	free(pop->lay_sizes);
+	free(pop->rate);
+	free(pop);
+
+	return 0;
+}
+
+struct dnn_population *dnn_create_population(struct dnn_net *net, int n_memb)
+{
+	int i, m;
+	int n_in, n_out;
+	size_t n_w;
+	struct dnn_population *pop;
+	struct pop_layer *lay;
+
+	if(!net || n_memb < 1)
+		return NULL;
+	/* trainable activations have per network parameters of their own,
+	 * and members are stored dense */
+	for(i = 0; i < net->num_lays - 1; ++i)
+		if(net->lays[i].n_aptx || net->lays[i].rank)
+			return NULL;
+
+	pop = calloc(1, sizeof *pop);
+	if(!pop)
+		return NULL;
+	pop->n_memb = n_memb;
+	pop->num_lays = net->num_lays;
+	pop->out_mode = net->out_mode;
+	pop->d_cost = &dnn_d_cost_mse;
+
+	pop->lay_sizes = malloc(sizeof *pop->lay_sizes * net->num_lays);
+	pop->lays = calloc(net->num_lays - 1, sizeof *pop->lays);
+	pop->rate = malloc(sizeof *pop->rate * n_memb);
+	if(!pop->lay_sizes || !pop->lays || !pop->rate)
+		goto fail;
+	memcpy(pop->lay_sizes, net->lay_sizes, sizeof *pop->lay_sizes * net->num_lays);
+	for(m = 0; m < n_memb; ++m)
+		pop->rate[m] = 1;
+
+	for(i = 0; i < net->num_lays - 1; ++i){
+		lay = &pop->lays[i];
+		n_in = net->lay_sizes[i];
+		n_out = net->lay_sizes[i + 1];
+		n_w = (size_t)n_out * n_in * n_memb;
+
+		lay->actv_func = net->lays[i].actv_func;
+		lay->d_actv_func = &dnn_d_act_swish;
+		lay->w = dnn_alloc_buf(sizeof *lay->w * n_w);
+		lay->d_w = dnn_alloc_buf(sizeof *lay->d_w * n_w);
+		lay->b = malloc(sizeof *lay->b * n_out * n_memb);
+		lay->d_b = malloc(sizeof *lay->d_b * n_out * n_memb);
+		lay->wtd_sum = malloc(sizeof *lay->wtd_sum * n_out * n_memb);
+		lay->act = malloc(sizeof *lay->act * n_out * n_memb);
+		lay->d_wtd_sum = malloc(sizeof *lay->d_wtd_sum * n_out * n_memb);
+		lay->d_act = malloc(sizeof *lay->d_act * n_out * n_memb);
+		if(!lay->w || !lay->d_w || !lay->b || !lay->d_b || !lay->wtd_sum ||
+				!lay->act || !lay->d_wtd_sum || !lay->d_act)
+			goto fail;
+		memset(lay->d_w, 0, sizeof *lay->d_w * n_w);
+		memset(lay->d_b, 0, sizeof *lay->d_b * n_out * n_memb);
+	}
+
+	/* every member starts as a copy of net */
+	for(m = 0; m < n_memb; ++m)
+		dnn_pop_import(pop, m, net);
+
+	return pop;
+
+fail:
+	dnn_destroy_population(pop);
+	return NULL;
+}
+
+/* same heuristic as dnn_init_net(), drawn in one go per layer so members
+ * don't end up with the same weights from a reseeded rand() */
+int dnn_init_population(struct dnn_population *pop)
+{
+	int i, j, k, m;
+	int n_in, n_out, n_memb;
+	float *xavier_wts;
+
+	if(!pop)
+		return -1;
+
+	n_memb = pop->n_memb;
+	for(i = 0; i < pop->num_lays - 1; ++i){
+		n_in = pop->lay_sizes[i];
+		n_out = pop->lay_sizes[i + 1];
+		xavier_wts = xavier_data(n_in, n_out * n_memb);
+		if(!xavier_wts)
+			return -1;
+
+		for(m = 0; m < n_memb; ++m)
+			for(j = 0; j < n_out; ++j){
+				pop->lays[i].b[j * n_memb + m] = 0;
+				for(k = 0; k < n_in; ++k)
+					pop->lays[i].w[((size_t)j * n_in + k) * n_memb + m] =
+						xavier_wts[((size_t)m * n_out + j) * n_in + k];
+			}
+		free(xavier_wts);
+	}
+
+	return 0;
+}
+
+int dnn_pop_set_rate(struct dnn_population *pop, int memb, float rate)
+{
+	if(!pop || memb < 0 || memb >= pop->n_memb)
+		return -1;
+
+	pop->rate[memb] = rate;
+
+	return 0;
+}
+
+int dnn_pop_set_d_act_func(struct dnn_population *pop, int lay_num,
+		float (*d_actv_func)(float x))
+{
+	if(!pop || lay_num <= 0 || lay_num >= pop->num_lays)
+		return -1;
+
+	pop->lays[lay_num - 1].d_actv_func = d_actv_func;
+
+	return 0;
+}
+
+int dnn_pop_set_d_cost_func(struct dnn_population *pop,
+		float (*d_cost_func)(float out, float want))
+{
+	if(!pop || !d_cost_func)
+		return -1;
+
+	pop->d_cost = d_cost_func;
+
+	return 0;
+}
+
+/* softmax of each member's n logits, strided by n_memb */
+static void pop_softmax(const float *z, float *p, int n, int n_memb)
+{
+	int j, m;
+	float max, sum;
+
+	for(m = 0; m < n_memb; ++m){
+		max = z[m];
+		for(j = 1; j < n; ++j)
+			max = z[j * n_memb + m] > max ? z[j * n_memb + m] : max;
+		sum = 0;
+		for(j = 0; j < n; ++j){
+			p[j * n_memb + m] = expf(z[j * n_memb + m] - max);
+			sum += p[j * n_memb + m];
+		}
+		for(j = 0; j < n; ++j)
+			p[j * n_memb + m] /= sum;
+	}
+}
+
+/* forward pass of every member, leaving each layer's weighted sums and
+ * activations in pop->lays, the input is the same for every member so the
+ * first layer reads it as a scalar per weight instead of a vector */
+static void pop_forward(struct dnn_population *pop, const float *inp)
+{
+	int i, j, k, m;
+	int n_in, n_out, n_memb;
+	const float *a, *w;
+	float *z;
+	struct pop_layer *lay;
+
+	n_memb = pop->n_memb;
+	a = NULL;
+	for(i = 0; i < pop->num_lays - 1; ++i){
+		lay = &pop->lays[i];
+		n_in = pop->lay_sizes[i];
+		n_out = pop->lay_sizes[i + 1];
+		for(j = 0; j < n_out; ++j){
+			z = &lay->wtd_sum[j * n_memb];
+			memcpy(z, &lay->b[j * n_memb], sizeof *z * n_memb);
+			w = &lay->w[(size_t)j * n_in * n_memb];
+			if(!i){
+				for(k = 0; k < n_in; ++k, w += n_memb)
+					for(m = 0; m < n_memb; ++m)
+						z[m] += w[m] * inp[k];
+				continue;
+			}
+			for(k = 0; k < n_in; ++k, w += n_memb)
+				for(m = 0; m < n_memb; ++m)
+					z[m] += w[m] * a[k * n_memb + m];
+		}
+
+		if(i == pop->num_lays - 2 && pop->out_mode == DNN_OUT_SOFTMAX)
+			pop_softmax(lay->wtd_sum, lay->act, n_out, n_memb);
+		else
+			for(j = 0; j < n_out * n_memb; ++j)
+				lay->act[j] = lay->actv_func(lay->wtd_sum[j]);
+		a = lay->act;
+	}
+}
+
+float *dnn_pop_test(struct dnn_population *pop, float *inp)
+{
+	int j, m;
+	int n_out;
+	float *act, *output;
+
+	if(!pop || !inp)
+		return NULL;
+
+	n_out = pop->lay_sizes[pop->num_lays - 1];
+	output = malloc(sizeof *output * n_out * pop->n_memb);
+	if(!output)
+		return NULL;
+
+	pop_forward(pop, inp);
+
+	act = pop->lays[pop->num_lays - 2].act;
+	for(m = 0; m < pop->n_memb; ++m)
+		for(j = 0; j < n_out; ++j)
+			output[m * n_out + j] = act[j * pop->n_memb + m];
+
+	return output;
+}
+
+int dnn_pop_train(struct dnn_population *pop, float *inp, float *want)
+{
+	int i, j, k, m;
+	int n_in, n_out, n_memb;
+	int softmax;
+	const float *a_prev, *w;
+	float *d_w, *dz, *d_a_prev;
+	struct pop_layer *lay, *out;
+
+	if(!pop || !inp || !want)
+		return -1;
+
+	n_memb = pop->n_memb;
+	softmax = pop->out_mode == DNN_OUT_SOFTMAX;
+	pop_forward(pop, inp);
+
+	out = &pop->lays[pop->num_lays - 2];
+	n_out = pop->lay_sizes[pop->num_lays - 1];
+	for(j = 0; j < n_out; ++j)
+		for(m = 0; m < n_memb; ++m){
+			if(softmax)
+				out->d_wtd_sum[j * n_memb + m] = out->act[j * n_memb + m] - want[j];
+			else
+				out->d_act[j * n_memb + m] = pop->d_cost(out->act[j * n_memb + m], want[j]);
+		}
+
+	for(i = pop->num_lays - 2; i >= 0; --i){
+		lay = &pop->lays[i];
+		n_in = pop->lay_sizes[i];
+		n_out = pop->lay_sizes[i + 1];
+
+		if(!(softmax && lay == out))
+			for(j = 0; j < n_out * n_memb; ++j)
+				lay->d_wtd_sum[j] = lay->d_actv_func(lay->wtd_sum[j]) * lay->d_act[j];
+
+		/* nothing below the first layer wants its input gradient */
+		if(!i){
+			for(j = 0; j < n_out; ++j){
+				dz = &lay->d_wtd_sum[j * n_memb];
+				for(m = 0; m < n_memb; ++m)
+					lay->d_b[j * n_memb + m] += dz[m];
+				d_w = &lay->d_w[(size_t)j * n_in * n_memb];
+				for(k = 0; k < n_in; ++k, d_w += n_memb)
+					for(m = 0; m < n_memb; ++m)
+						d_w[m] += dz[m] * inp[k];
+			}
+			break;
+		}
+
+		a_prev = pop->lays[i - 1].act;
+		d_a_prev = pop->lays[i - 1].d_act;
+		memset(d_a_prev, 0, sizeof *d_a_prev * n_in * n_memb);
+		for(j = 0; j < n_out; ++j){
+			dz = &lay->d_wtd_sum[j * n_memb];
+			for(m = 0; m < n_memb; ++m)
+				lay->d_b[j * n_memb + m] += dz[m];
+			w = &lay->w[(size_t)j * n_in * n_memb];
+			d_w = &lay->d_w[(size_t)j * n_in * n_memb];
+			for(k = 0; k < n_in; ++k, w += n_memb, d_w += n_memb)
+				for(m = 0; m < n_memb; ++m){
+					d_w[m] += dz[m] * a_prev[k * n_memb + m];
+					d_a_prev[k * n_memb + m] += dz[m] * w[m];
+				}
+		}
+	}
+	++pop->n_acc;
+
+	return 0;
+}
+
+int dnn_pop_apply(struct dnn_population *pop, float train_aggr)
+{
+	int i, j, m;
+	int n_in, n_out, n_memb;
+	size_t p, n_w;
+	float *step;
+	struct pop_layer *lay;
+
+	if(!pop)
+		return -1;
+	if(!pop->n_acc)
+		return 0;
+
+	n_memb = pop->n_memb;
+	step = malloc(sizeof *step * n_memb);
+	if(!step)
+		return -1;
+	for(m = 0; m < n_memb; ++m)
+		step[m] = -1 * train_aggr * pop->rate[m] / (float)pop->n_acc;
+
+	for(i = 0; i < pop->num_lays - 1; ++i){
+		lay = &pop->lays[i];
+		n_in = pop->lay_sizes[i];
+		n_out = pop->lay_sizes[i + 1];
+		n_w = (size_t)n_out * n_in;
+		for(p = 0; p < n_w; ++p)
+			for(m = 0; m < n_memb; ++m)
+				lay->w[p * n_memb + m] += step[m] * lay->d_w[p * n_memb + m];
+		for(j = 0; j < n_out; ++j)
+			for(m = 0; m < n_memb; ++m)
+				lay->b[j * n_memb + m] += step[m] * lay->d_b[j * n_memb + m];
+		memset(lay->d_w, 0, sizeof *lay->d_w * n_w * n_memb);
+		memset(lay->d_b, 0, sizeof *lay->d_b * n_out * n_memb);
+	}
+	pop->n_acc = 0;
+	free(step);
+
+	return 0;
+}
+
+int dnn_pop_import(struct dnn_population *pop, int memb, struct dnn_net *net)
+{
+	int i, j, k;
+	int n_in, n_out, n_memb;
+
+	if(!pop || !net || memb < 0 || memb >= pop->n_memb)
+		return -1;
+	if(net->num_lays != pop->num_lays)
+		return -1;
+	for(i = 0; i < net->num_lays; ++i)
+		if(net->lay_sizes[i] != pop->lay_sizes[i])
+			return -1;
+	/* as for dnn_create_population(), members have no APTx parameters
+	 * and are stored dense */
+	for(i = 0; i < net->num_lays - 1; ++i)
+		if(net->lays[i].n_aptx || net->lays[i].rank)
+			return -1;
+
+	n_memb = pop->n_memb;
+	for(i = 0; i < pop->num_lays - 1; ++i){
+		n_in = pop->lay_sizes[i];
+		n_out = pop->lay_sizes[i + 1];
+		for(j = 0; j < n_out; ++j){
+			pop->lays[i].b[j * n_memb + memb] = net->lays[i].bias[j];
+			for(k = 0; k < n_in; ++k)
+				pop->lays[i].w[((size_t)j * n_in + k) * n_memb + memb] =
+					net->lays[i].wm[j][k];
+		}
+	}
+
+	return 0;
+}
+
+struct dnn_net *dnn_pop_export(struct dnn_population *pop, int memb)
+{
+	int i, j, k;
+	int n_in, n_out, n_memb;
+	struct dnn_net *net;
+
+	if(!pop || memb < 0 || memb >= pop->n_memb)
+		return NULL;
+
+	net = dnn_create_network(pop->num_lays, pop->lay_sizes);
+	if(!net)
+		return NULL;
+	net->out_mode = pop->out_mode;
+
+	n_memb = pop->n_memb;
+	for(i = 0; i < pop->num_lays - 1; ++i){
+		n_in = pop->lay_sizes[i];
+		n_out = pop->lay_sizes[i + 1];
+		net->lays[i].actv_func = pop->lays[i].actv_func;
+		for(j = 0; j < n_out; ++j){
+			net->lays[i].bias[j] = pop->lays[i].b[j * n_memb + memb];
+			for(k = 0; k < n_in; ++k)
+				net->lays[i].wm[j][k] =
+					pop->lays[i].w[((size_t)j * n_in + k) * n_memb + memb];
+		}
+	}
+
+	return net;
+}
@@ -0,0 +1,334 @@
+/* sam's Dank Neural Network library (libdanknn)
+ *
+ * Copyright Sam Popham 2020
+ *
+ * this file is part of libdanknn
+ *
+ *  libdanknn is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* model stores
+ *
+ * every file of a directory is indexed by name when the store is created,
+ * nets are loaded the first time they are asked for and kept on a most
+ * recently used list, when the loaded nets add up to more than the budget
+ * the least recently used ones nobody holds are destroyed
+ * a load runs without the store's lock, other threads asking for the same
+ * net wait for it and everyone else carries on */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#include "danknn_intern.h"
+
+struct store_entry{
+	char *name;
+	struct dnn_net *net;	/* NULL while not resident */
+	long bytes;
+	int refs;
+	int loading;
+
+	/* most recently used list of resident entries */
+	struct store_entry *prev;
+	struct store_entry *next;
+};
+
+struct dnn_model_store{
+	char *dir;
+	struct store_entry *ents;	/* sorted by name */
+	int n_ents;
+
+	long budget;
+	long resident;
+	struct store_entry *mru;
+	struct store_entry *lru;
+
+	pthread_mutex_t lock;
+	pthread_cond_t loaded;	/* broadcast when any load finishes */
+};
+
+/* memory held by net's parameters */
+static long net_bytes(struct dnn_net *net)
+{
+	int i;
+	long n_in, n_out, bytes;
+	struct dnn_layer *lay;
+
+	bytes = sizeof *net + sizeof *net->lays * (net->num_lays - 1) +
+		sizeof *net->lay_sizes * net->num_lays;
+	for(i = 0; i < net->num_lays - 1; ++i){
+		lay = &net->lays[i];
+		n_in = net->lay_sizes[i];
+		n_out = net->lay_sizes[i + 1];
+		bytes += sizeof *lay->bias * n_out;
+		bytes += sizeof *lay->aptx * 3 * lay->n_aptx;
+		if(lay->rank){
+			bytes += sizeof *lay->lr_u * lay->rank * (n_in + n_out);
+			continue;
+		}
+		bytes += sizeof *lay->wm * n_out;
+		bytes += sizeof *lay->wm_alloc_handle * n_in * n_out;
+		if(lay->wm_t)
+			bytes += sizeof *lay->wm_t * n_in * n_out;
+	}
+
+	return bytes;
+}
+
+static int entry_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct store_entry *)a)->name,
+			((const struct store_entry *)b)->name);
+}
+
+static void lru_unlink(struct dnn_model_store *s, struct store_entry *e)
+{
+	if(e->prev)
+		e->prev->next = e->next;
+	else
+		s->mru = e->next;
+	if(e->next)
+		e->next->prev = e->prev;
+	else
+		s->lru = e->prev;
+	e->prev = e->next = NULL;
+}
+
+static void lru_push(struct dnn_model_store *s, struct store_entry *e)
+{
+	e->prev = NULL;
+	e->next = s->mru;
+	if(s->mru)
+		s->mru->prev = e;
+	else
+		s->lru = e;
+	s->mru = e;
+}
+
+/* destroys unheld nets from the least recently used end until the store
+ * fits its budget, called with s->lock held */
+static void store_evict(struct dnn_model_store *s)
+{
+	struct store_entry *e, *prev;
+
+	for(e = s->lru; e && s->resident > s->budget; e = prev){
+		prev = e->prev;
+		if(e->refs)
+			continue;
+		lru_unlink(s, e);
+		dnn_destroy_net(e->net);
+		e->net = NULL;
+		s->resident -= e->bytes;
+		e->bytes = 0;
+	}
+}
+
+int dnn_destroy_model_store(struct dnn_model_store *s)
+{
+	int i;
+
+	if(!s)
+		return -1;
+
+	for(i = 0; i < s->n_ents; ++i){
+		if(s->ents[i].net)
+			dnn_destroy_net(s->ents[i].net);
+		free(s->ents[i].name);
+	}
+	pthread_mutex_destroy(&s->lock);
+	pthread_cond_destroy(&s->loaded);
+	free(s->ents);
+	free(s->dir);
+	free(s);
+
+	return 0;
+}
+
+struct dnn_model_store *dnn_create_model_store(const char *dir, long budget)
+{
+	int n_alloc;
+	char *path;
+	void *tmp;
+	DIR *dp;
+	struct dirent *de;
+	struct stat st;
+	struct dnn_model_store *s;
+
+	if(!dir)
+		return NULL;
+
+	dp = opendir(dir);
+	if(!dp)
+		return NULL;
+
+	s = calloc(1, sizeof *s);
+	if(!s){
+		closedir(dp);
+		return NULL;
+	}
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->loaded, NULL);
+	s->budget = budget;
+	s->dir = strdup(dir);
+	path = malloc(strlen(dir) + 2 + 256);
+	if(!s->dir || !path){
+		free(path);
+		closedir(dp);
+		dnn_destroy_model_store(s);
+		return NULL;
+	}
+
+	n_alloc = 0;
+	while((de = readdir(dp))){
+		if(de->d_name[0] == '.' || strlen(de->d_name) > 255)
+			continue;
+		sprintf(path, "%s/%s", dir, de->d_name);
+		if(stat(path, &st) || !S_ISREG(st.st_mode))
+			continue;
+
+		if(s->n_ents == n_alloc){
+			n_alloc = n_alloc ? 2 * n_alloc : 64;
+			tmp = realloc(s->ents, sizeof *s->ents * n_alloc);
+			if(!tmp)
+				break;
+			s->ents = tmp;
+		}
+		memset(&s->ents[s->n_ents], 0, sizeof *s->ents);
+		s->ents[s->n_ents].name = strdup(de->d_name);
+		if(!s->ents[s->n_ents].name)
+			break;
+		++s->n_ents;
+	}
+	free(path);
+	closedir(dp);
+
+	/* stopped short, a partial index would hide models */
+	if(de){
+		dnn_destroy_model_store(s);
+		return NULL;
+	}
+
+	if(s->n_ents)
+		qsort(s->ents, s->n_ents, sizeof *s->ents, entry_cmp);
+
+	return s;
+}
+
+struct dnn_net *dnn_store_get(struct dnn_model_store *s, const char *name)
+{
+	char *path;
+	struct store_entry key, *e;
+	struct dnn_net *net;
+
+	if(!s || !name || !s->n_ents)
+		return NULL;
+
+	key.name = (char *)name;
+	e = bsearch(&key, s->ents, s->n_ents, sizeof *s->ents, entry_cmp);
+	if(!e)
+		return NULL;
+
+	pthread_mutex_lock(&s->lock);
+	while(e->loading)
+		pthread_cond_wait(&s->loaded, &s->lock);
+
+	if(!e->net){
+		e->loading = 1;
+		pthread_mutex_unlock(&s->lock);
+
+		net = NULL;
+		path = malloc(strlen(s->dir) + strlen(name) + 2);
+		if(path){
+			sprintf(path, "%s/%s", s->dir, name);
+			net = dnn_load_net(path);
+			free(path);
+		}
+
+		pthread_mutex_lock(&s->lock);
+		e->loading = 0;
+		pthread_cond_broadcast(&s->loaded);
+		if(!net){
+			pthread_mutex_unlock(&s->lock);
+			return NULL;
+		}
+		e->net = net;
+		e->bytes = net_bytes(net);
+		s->resident += e->bytes;
+		lru_push(s, e);
+	}else{
+		lru_unlink(s, e);
+		lru_push(s, e);
+	}
+
+	++e->refs;
+	net = e->net;
+	store_evict(s);
+	pthread_mutex_unlock(&s->lock);
+
+	return net;
+}
+
+int dnn_store_release(struct dnn_model_store *s, struct dnn_net *net)
+{
+	struct store_entry *e;
+
+	if(!s || !net)
+		return -1;
+
+	pthread_mutex_lock(&s->lock);
+	for(e = s->mru; e; e = e->next)
+		if(e->net == net)
+			break;
+	if(!e || !e->refs){
+		pthread_mutex_unlock(&s->lock);
+		return -1;
+	}
+	--e->refs;
+	store_evict(s);
+	pthread_mutex_unlock(&s->lock);
+
+	return 0;
+}
+
+float *dnn_store_test(struct dnn_model_store *s, const char *name, float *inp)
+{
+	float *output;
+	struct dnn_net *net;
+
+	net = dnn_store_get(s, name);
+	if(!net)
+		return NULL;
+	output = dnn_test(net, inp);
+	dnn_store_release(s, net);
+
+	return output;
+}
+
+long dnn_store_resident(struct dnn_model_store *s)
+{
+	long bytes;
+
+	if(!s)
+		return 0;
+
+	pthread_mutex_lock(&s->lock);
+	bytes = s->resident;
+	pthread_mutex_unlock(&s->lock);
+
+	return bytes;
+}
@@ -0,0 +1,516 @@
+/* sam's Dank Neural Network library (libdanknn)
+ *
+ * Copyright Sam Popham 2020
+ *
+ * this file is part of libdanknn
+ *
+ *  libdanknn is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* dense layer kernels and the autotuner choosing between them
+ *
+ * each layer has a matvec kernel (how many rows and how many running sums
+ * per row are kept in registers) and a row block (how many weight rows a
+ * batched forward pass pushes every example through before moving on),
+ * the best of both depends on the layer's shape and the cpu, so they are
+ * benchmarked per host and remembered in a tuning cache file of lines
+ *
+ *	<cpu model>\t<inputs>\t<outputs>\t<kernel>\t<row block>
+ *
+ * the cache is read once per process, on the first load, and this cpu's
+ * lines kept in memory for every load after */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#include "danknn_intern.h"
+
+/* row blocks tried by dnn_autotune(), 0 is the whole layer */
+static const int tune_row_blocks[] = {0, 8, 32, 128};
+#define N_ROW_BLOCKS	(int)(sizeof tune_row_blocks / sizeof *tune_row_blocks)
+
+/* examples per benchmarked batch, and how long to time each candidate */
+#define TUNE_BATCH	16
+#define TUNE_MIN_NS	2000000L
+#define TUNE_MIN_REPS	3
+
+#define TUNE_LINE_MAX	512
+
+/* this cpu's tuning, one entry per layer shape */
+struct tune_entry{
+	int n_in;
+	int n_out;
+	int kern;
+	int row_block;
+};
+
+static struct tune_entry *tune_ents;
+static int tune_n_ents;
+static int tune_have_cache;
+static pthread_once_t tune_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t tune_lock = PTHREAD_MUTEX_INITIALIZER;
+
+	/* kernels, out[j] = w[j] . x for n_rows rows of n_in weights */
+
+/* reference, one row and one running sum at a time */
+static void mv_r1u1(const float *w, int n_in, int n_rows, const float *x, float *out)
+{
+	int j, k;
+	float sum;
+
+	for(j = 0; j < n_rows; ++j, w += n_in){
+		sum = 0;
+		for(k = 0; k < n_in; ++k)
+			sum += w[k] * x[k];
+		out[j] = sum;
+	}
+}
+
+/* four independent sums per row, breaks the add dependency chain and lets
+ * the compiler put them in one vector register */
+static void mv_r1u4(const float *w, int n_in, int n_rows, const float *x, float *out)
+{
+	int j, k;
+	float s0, s1, s2, s3;
+
+	for(j = 0; j < n_rows; ++j, w += n_in){
+		s0 = s1 = s2 = s3 = 0;
+		for(k = 0; k + 4 <= n_in; k += 4){
+			s0 += w[k] * x[k];
+			s1 += w[k + 1] * x[k + 1];
+			s2 += w[k + 2] * x[k + 2];
+			s3 += w[k + 3] * x[k + 3];
+		}
+		for(; k < n_in; ++k)
+			s0 += w[k] * x[k];
+		out[j] = (s0 + s1) + (s2 + s3);
+	}
+}
+
+/* four rows at once, every load of x is shared by four rows */
+static void mv_r4u1(const float *w, int n_in, int n_rows, const float *x, float *out)
+{
+	int j, k;
+	float s0, s1, s2, s3;
+	const float *w0, *w1, *w2, *w3;
+
+	for(j = 0; j + 4 <= n_rows; j += 4){
+		w0 = &w[j * n_in];
+		w1 = w0 + n_in;
+		w2 = w1 + n_in;
+		w3 = w2 + n_in;
+		s0 = s1 = s2 = s3 = 0;
+		for(k = 0; k < n_in; ++k){
+			s0 += w0[k] * x[k];
+			s1 += w1[k] * x[k];
+			s2 += w2[k] * x[k];
+			s3 += w3[k] * x[k];
+		}
+		out[j] = s0;
+		out[j + 1] = s1;
+		out[j + 2] = s2;
+		out[j + 3] = s3;
+	}
+	mv_r1u1(&w[j * n_in], n_in, n_rows - j, x, &out[j]);
+}
+
+/* two rows of four sums each */
+static void mv_r2u4(const float *w, int n_in, int n_rows, const float *x, float *out)
+{
+	int j, k;
+	float a0, a1, a2, a3, b0, b1, b2, b3;
+	const float *wa, *wb;
+
+	for(j = 0; j + 2 <= n_rows; j += 2){
+		wa = &w[j * n_in];
+		wb = wa + n_in;
+		a0 = a1 = a2 = a3 = 0;
+		b0 = b1 = b2 = b3 = 0;
+		for(k = 0; k + 4 <= n_in; k += 4){
+			a0 += wa[k] * x[k];
+			a1 += wa[k + 1] * x[k + 1];
+			a2 += wa[k + 2] * x[k + 2];
+			a3 += wa[k + 3] * x[k + 3];
+			b0 += wb[k] * x[k];
+			b1 += wb[k + 1] * x[k + 1];
+			b2 += wb[k + 2] * x[k + 2];
+			b3 += wb[k + 3] * x[k + 3];
+		}
+		for(; k < n_in; ++k){
+			a0 += wa[k] * x[k];
+			b0 += wb[k] * x[k];
+		}
+		out[j] = (a0 + a1) + (a2 + a3);
+		out[j + 1] = (b0 + b1) + (b2 + b3);
+	}
+	mv_r1u4(&w[j * n_in], n_in, n_rows - j, x, &out[j]);
+}
+
+const dnn_mv_kern dnn_mv_kerns[DNN_N_KERNS] = {
+	mv_r1u1,
+	mv_r1u4,
+	mv_r4u1,
+	mv_r2u4,
+};
+
+	/* tuning cache */
+
+/* whether layer lay is the first of its shape in net, later ones share
+ * its tuning */
+static int tune_first_of_shape(struct dnn_net *net, int lay)
+{
+	int i;
+
+	for(i = 0; i < lay; ++i)
+		if(!net->lays[i].rank && net->lay_sizes[i] == net->lay_sizes[lay] &&
+				net->lay_sizes[i + 1] == net->lay_sizes[lay + 1])
+			return 0;
+	return 1;
+}
+
+/* the "model name" line of /proc/cpuinfo, without tabs or trailing space */
+static void tune_cpu_model(char *model, size_t len)
+{
+	char line[TUNE_LINE_MAX];
+	char *p;
+	FILE *fp;
+
+	snprintf(model, len, "unknown");
+
+	fp = fopen("/proc/cpuinfo", "r");
+	if(!fp)
+		return;
+	while(fgets(line, sizeof line, fp)){
+		if(strncmp(line, "model name", 10))
+			continue;
+		p = strchr(line, ':');
+		if(!p)
+			break;
+		for(++p; *p == ' '; ++p)
+			;
+		snprintf(model, len, "%s", p);
+		for(p = model; *p; ++p)
+			if(*p == '\t')
+				*p = ' ';
+		while(p > model && (p[-1] == '\n' || p[-1] == ' '))
+			*--p = '\0';
+		break;
+	}
+	fclose(fp);
+}
+
+/* $DNN_TUNE_CACHE, else ~/.cache/danknn.tune */
+static int tune_cache_path(char *path, size_t len)
+{
+	const char *env;
+
+	env = getenv("DNN_TUNE_CACHE");
+	if(env && *env){
+		snprintf(path, len, "%s", env);
+		return 0;
+	}
+	env = getenv("HOME");
+	if(!env || !*env)
+		return -1;
+	snprintf(path, len, "%s/.cache/danknn.tune", env);
+	return 0;
+}
+
+/* splits a cache line into its model and four numbers */
+static int tune_parse(char *line, char **model, int *n_in, int *n_out,
+		int *kern, int *row_block)
+{
+	char *tab;
+
+	tab = strchr(line, '\t');
+	if(!tab)
+		return -1;
+	*tab = '\0';
+	*model = line;
+
+	if(sscanf(tab + 1, "%d\t%d\t%d\t%d", n_in, n_out, kern, row_block) != 4)
+		return -1;
+	if(*kern < 0 || *kern >= DNN_N_KERNS || *row_block < 0)
+		return -1;
+	return 0;
+}
+
+/* adds or replaces the entry for a shape, called with tune_lock held */
+static int tune_remember(int n_in, int n_out, int kern, int row_block)
+{
+	int i;
+	struct tune_entry *tmp;
+
+	for(i = 0; i < tune_n_ents; ++i)
+		if(tune_ents[i].n_in == n_in && tune_ents[i].n_out == n_out)
+			break;
+	if(i == tune_n_ents){
+		tmp = realloc(tune_ents, sizeof *tune_ents * (tune_n_ents + 1));
+		if(!tmp)
+			return -1;
+		tune_ents = tmp;
+		++tune_n_ents;
+	}
+	tune_ents[i].n_in = n_in;
+	tune_ents[i].n_out = n_out;
+	tune_ents[i].kern = kern;
+	tune_ents[i].row_block = row_block;
+
+	return 0;
+}
+
+/* reads this cpu's lines of the cache, once per process, later lines for a
+ * shape win as they did when every load read the file */
+static void tune_load(void)
+{
+	int n_in, n_out, kern, row_block;
+	char path[TUNE_LINE_MAX];
+	char cpu[TUNE_LINE_MAX];
+	char line[TUNE_LINE_MAX];
+	char *model;
+	FILE *fp;
+
+	if(tune_cache_path(path, sizeof path))
+		return;
+	fp = fopen(path, "r");
+	if(!fp)
+		return;
+
+	tune_cpu_model(cpu, sizeof cpu);
+	pthread_mutex_lock(&tune_lock);
+	tune_have_cache = 1;
+	while(fgets(line, sizeof line, fp)){
+		if(tune_parse(line, &model, &n_in, &n_out, &kern, &row_block))
+			continue;
+		if(strcmp(model, cpu))
+			continue;
+		tune_remember(n_in, n_out, kern, row_block);
+	}
+	pthread_mutex_unlock(&tune_lock);
+	fclose(fp);
+}
+
+int dnn_apply_tuning(struct dnn_net *net)
+{
+	int i, j;
+
+	if(!net)
+		return -1;
+
+	pthread_once(&tune_once, tune_load);
+	pthread_mutex_lock(&tune_lock);
+	if(!tune_have_cache){
+		pthread_mutex_unlock(&tune_lock);
+		return -1;
+	}
+	for(i = 0; i < net->num_lays - 1; ++i){
+		/* the cache is for dense layers */
+		if(net->lays[i].rank)
+			continue;
+		for(j = 0; j < tune_n_ents; ++j){
+			if(net->lay_sizes[i] != tune_ents[j].n_in ||
+					net->lay_sizes[i + 1] != tune_ents[j].n_out)
+				continue;
+			net->lays[i].kern = tune_ents[j].kern;
+			net->lays[i].row_block = tune_ents[j].row_block;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&tune_lock);
+
+	return 0;
+}
+
+/* rewrites the cache with net's choices for this cpu replacing any older
+ * entries for the same shapes, via a temporary file so concurrent readers
+ * never see half a cache */
+static int tune_save(struct dnn_net *net)
+{
+	int i;
+	int n_in, n_out, kern, row_block;
+	int replaced;
+	char path[TUNE_LINE_MAX];
+	char tmp_path[TUNE_LINE_MAX + 32];
+	char cpu[TUNE_LINE_MAX];
+	char line[TUNE_LINE_MAX];
+	char copy[TUNE_LINE_MAX];
+	char *model;
+	char *slash;
+	FILE *in, *out;
+
+	if(tune_cache_path(path, sizeof path))
+		return -1;
+	tune_cpu_model(cpu, sizeof cpu);
+
+	snprintf(tmp_path, sizeof tmp_path, "%s.%ld", path, (long)getpid());
+	out = fopen(tmp_path, "w");
+	slash = strrchr(path, '/');
+	if(!out && slash && !getenv("DNN_TUNE_CACHE")){
+		/* first use, ~/.cache may not exist yet */
+		*slash = '\0';
+		mkdir(path, 0755);
+		*slash = '/';
+		out = fopen(tmp_path, "w");
+	}
+	if(!out)
+		return -1;
+
+	in = fopen(path, "r");
+	while(in && fgets(line, sizeof line, in)){
+		memcpy(copy, line, sizeof copy);
+		if(tune_parse(copy, &model, &n_in, &n_out, &kern, &row_block))
+			continue;
+		replaced = 0;
+		if(!strcmp(model, cpu))
+			for(i = 0; i < net->num_lays - 1; ++i)
+				if(!net->lays[i].rank && net->lay_sizes[i] == n_in &&
+						net->lay_sizes[i + 1] == n_out)
+					replaced = 1;
+		if(!replaced)
+			fputs(line, out);
+	}
+	if(in)
+		fclose(in);
+
+	for(i = 0; i < net->num_lays - 1; ++i)
+		if(!net->lays[i].rank && tune_first_of_shape(net, i))
+			fprintf(out, "%s\t%d\t%d\t%d\t%d\n", cpu, net->lay_sizes[i],
+					net->lay_sizes[i + 1], net->lays[i].kern,
+					net->lays[i].row_block);
+
+	if(fclose(out)){
+		remove(tmp_path);
+		return -1;
+	}
+	if(rename(tmp_path, path)){
+		remove(tmp_path);
+		return -1;
+	}
+
+	/* and for later loads in this process, which don't reread the file */
+	pthread_once(&tune_once, tune_load);
+	pthread_mutex_lock(&tune_lock);
+	tune_have_cache = 1;
+	for(i = 0; i < net->num_lays - 1; ++i)
+		if(!net->lays[i].rank && tune_first_of_shape(net, i))
+			tune_remember(net->lay_sizes[i], net->lay_sizes[i + 1],
+					net->lays[i].kern, net->lays[i].row_block);
+	pthread_mutex_unlock(&tune_lock);
+
+	return 0;
+}
+
+	/* benchmarking */
+
+static long tune_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/* ns per batch of TUNE_BATCH examples through layer lay with the given
+ * kernel and row block, the same loop nest as the batched forward pass */
+static double tune_time(struct dnn_net *net, int lay, int kern, int row_block,
+		const float *x, float *out)
+{
+	int b, jb, reps;
+	int n_in, n_out, rb;
+	long start, elapsed;
+
+	n_in = net->lay_sizes[lay];
+	n_out = net->lay_sizes[lay + 1];
+	rb = row_block ? row_block : n_out;
+
+	reps = 0;
+	start = tune_now_ns();
+	do{
+		for(jb = 0; jb < n_out; jb += rb)
+			for(b = 0; b < TUNE_BATCH; ++b)
+				dnn_mv_kerns[kern](net->lays[lay].wm[jb], n_in,
+						n_out - jb < rb ? n_out - jb : rb,
+						&x[b * n_in], &out[b * n_out + jb]);
+		++reps;
+		elapsed = tune_now_ns() - start;
+	}while(elapsed < TUNE_MIN_NS || reps < TUNE_MIN_REPS);
+
+	return (double)elapsed / reps;
+}
+
+int dnn_autotune(struct dnn_net *net)
+{
+	int i, j, k, r;
+	int max_size;
+	double t, best;
+	float *x, *out;
+
+	if(!net)
+		return -1;
+
+	max_size = 0;
+	for(i = 0; i < net->num_lays; ++i)
+		if(net->lay_sizes[i] > max_size)
+			max_size = net->lay_sizes[i];
+
+	x = malloc(sizeof *x * TUNE_BATCH * max_size);
+	out = malloc(sizeof *out * TUNE_BATCH * max_size);
+	if(!x || !out){
+		free(x);
+		free(out);
+		return -1;
+	}
+	for(i = 0; i < TUNE_BATCH * max_size; ++i)
+		x[i] = (float)rand() / RAND_MAX - 0.5f;
+
+	for(i = 0; i < net->num_lays - 1; ++i){
+		/* factored layers keep the default kernel */
+		if(net->lays[i].rank)
+			continue;
+		if(!tune_first_of_shape(net, i)){
+			for(j = 0; j < i; ++j)
+				if(!net->lays[j].rank && net->lay_sizes[j] == net->lay_sizes[i] &&
+						net->lay_sizes[j + 1] == net->lay_sizes[i + 1])
+					break;
+			net->lays[i].kern = net->lays[j].kern;
+			net->lays[i].row_block = net->lays[j].row_block;
+			continue;
+		}
+
+		best = -1;
+		for(k = 0; k < DNN_N_KERNS; ++k){
+			for(r = 0; r < N_ROW_BLOCKS; ++r){
+				/* blocks at least as big as the layer are all the same */
+				if(tune_row_blocks[r] >= net->lay_sizes[i + 1])
+					continue;
+				t = tune_time(net, i, k, tune_row_blocks[r], x, out);
+				if(best < 0 || t < best){
+					best = t;
+					net->lays[i].kern = k;
+					net->lays[i].row_block = tune_row_blocks[r];
+				}
+			}
+		}
+	}
+
+	free(x);
+	free(out);
+
+	return tune_save(net);
+}
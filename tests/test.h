@@ -0,0 +1,160 @@
+/* sam's Dank Neural Network library (libdanknn)
+ *
+ * Copyright Sam Popham 2020
+ *
+ * this file is part of libdanknn
+ *
+ *  libdanknn is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef DNN_TEST
+#define DNN_TEST
+
+/* shared bits of the test programs, each one is a main() running a list
+ * of checks against the plain reference loops and exiting nonzero if any
+ * failed */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "danknn_intern.h"
+
+static int test_fails;
+static int test_checks;
+
+/* counts a check, reporting it if cond is false */
+#define CHECK(cond, ...) do{ \
+	++test_checks; \
+	if(!(cond)){ \
+		++test_fails; \
+		fprintf(stderr, "%s:%d: ", __FILE__, __LINE__); \
+		fprintf(stderr, __VA_ARGS__); \
+		fputc('\n', stderr); \
+	} \
+}while(0)
+
+/* own generator so runs are repeatable, dnn_init_net() reseeds rand() */
+static unsigned long test_seed = 1;
+
+static inline unsigned test_rand(void)
+{
+	test_seed = test_seed * 6364136223846793005UL + 1442695040888963407UL;
+	return test_seed >> 33;
+}
+
+/* uniform on [lo, hi] */
+static inline int test_randint(int lo, int hi)
+{
+	return lo + test_rand() % (hi - lo + 1);
+}
+
+static inline float test_randf(void)
+{
+	return 2 * (test_rand() / (float)0x7fffffff) - 1;
+}
+
+static inline void test_fill(float *x, int n)
+{
+	int i;
+
+	for(i = 0; i < n; ++i)
+		x[i] = test_randf();
+}
+
+/* a, b equal to within atol + rtol * |b| */
+static inline int test_close(float a, float b, float atol, float rtol)
+{
+	return fabsf(a - b) <= atol + rtol * fabsf(b);
+}
+
+static inline float test_max_diff(const float *a, const float *b, int n)
+{
+	int i;
+	float d;
+
+	/* written so a nan makes the result nan */
+	d = 0;
+	for(i = 0; i < n && d == d; ++i)
+		if(!(fabsf(a[i] - b[i]) <= d))
+			d = fabsf(a[i] - b[i]);
+	return d;
+}
+
+/* randomly initialized network of num_lays layers between 1 and max_size
+ * wide */
+static inline struct dnn_net *test_net(int num_lays, int max_size)
+{
+	int i;
+	int lay_sizes[16];
+	struct dnn_net *net;
+
+	for(i = 0; i < num_lays; ++i)
+		lay_sizes[i] = test_randint(1, max_size);
+	net = dnn_create_network(num_lays, lay_sizes);
+	if(!net || dnn_init_net(net)){
+		fprintf(stderr, "can't create a test network\n");
+		exit(1);
+	}
+
+	return net;
+}
+
+/* reference forward pass, plain loops over wm (or lr_u * lr_v) in double,
+ * output written to out */
+static inline void test_forward(struct dnn_net *net, const float *inp, float *out)
+{
+	int i, j, k, c;
+	int n_in, n_out;
+	double sum, t;
+	float *a_in, *a_out;
+	struct dnn_layer *lay;
+
+	a_in = malloc(sizeof *a_in * net->lay_sizes[0]);
+	memcpy(a_in, inp, sizeof *a_in * net->lay_sizes[0]);
+	for(i = 0; i < net->num_lays - 1; ++i){
+		lay = &net->lays[i];
+		n_in = net->lay_sizes[i];
+		n_out = net->lay_sizes[i + 1];
+		a_out = malloc(sizeof *a_out * n_out);
+		for(j = 0; j < n_out; ++j){
+			sum = lay->bias[j];
+			for(k = 0; k < n_in; ++k){
+				if(lay->rank){
+					t = 0;
+					for(c = 0; c < lay->rank; ++c)
+						t += (double)lay->lr_u[j * lay->rank + c] *
+							lay->lr_v[c * n_in + k];
+				}else{
+					t = lay->wm[j][k];
+				}
+				sum += t * a_in[k];
+			}
+			a_out[j] = sum;
+		}
+		dnn_activate(net, i, a_out, a_out);
+		free(a_in);
+		a_in = a_out;
+	}
+	memcpy(out, a_in, sizeof *out * net->lay_sizes[net->num_lays - 1]);
+	free(a_in);
+}
+
+static inline int test_report(const char *name)
+{
+	printf("%s: %d checks, %d failed\n", name, test_checks, test_fails);
+	return test_fails ? 1 : 0;
+}
+
+#endif /* DNN_TEST */
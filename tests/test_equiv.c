@@ -0,0 +1,711 @@
+/* sam's Dank Neural Network library (libdanknn)
+ *
+ * Copyright Sam Popham 2020
+ *
+ * this file is part of libdanknn
+ *
+ *  libdanknn is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* every optimized path against the plain loops, or against the path it
+ * replaces, on random shapes
+ * paths that only reorder which thread or batch computes a row have to
+ * match exactly, ones that change the arithmetic within a tolerance */
+
+#include <unistd.h>
+#include <pthread.h>
+
+#include "test.h"
+
+#define EQ_SHAPES	20
+#define EQ_ATOL		1e-5f
+#define EQ_RTOL		1e-4f
+
+static char tmp_path[] = "/tmp/danknn_testXXXXXX";
+
+/* a copy of net through a save file, so also a save/load check */
+static struct dnn_net *copy_net(struct dnn_net *net)
+{
+	struct dnn_net *copy;
+
+	CHECK(!dnn_save_net(net, tmp_path), "dnn_save_net failed");
+	copy = dnn_load_net(tmp_path);
+	if(!copy){
+		fprintf(stderr, "dnn_load_net failed\n");
+		exit(1);
+	}
+
+	return copy;
+}
+
+/* dnn_test() of net within tolerance of the reference, or exactly equal to
+ * want if that is given */
+static void check_test(struct dnn_net *net, const float *inp, const float *want,
+		const char *what)
+{
+	int j;
+	int n_out;
+	float *out, *ref;
+
+	n_out = net->lay_sizes[net->num_lays - 1];
+	out = dnn_test(net, (float *)inp);
+	if(want){
+		CHECK(!memcmp(out, want, sizeof *out * n_out), "%s: output differs by %g",
+				what, test_max_diff(out, want, n_out));
+	}else{
+		ref = malloc(sizeof *ref * n_out);
+		test_forward(net, inp, ref);
+		for(j = 0; j < n_out; ++j)
+			CHECK(test_close(out[j], ref[j], EQ_ATOL, EQ_RTOL),
+					"%s: output %d is %g, reference %g", what, j, out[j], ref[j]);
+		free(ref);
+	}
+	free(out);
+}
+
+/* each dnn_mv_kerns entry against a double dot product */
+/* the rational tanh the APTx loops use, against the real one */
+static void test_tanh(void)
+{
+	int i;
+	float x;
+	double err, max_err;
+
+	max_err = 0;
+	for(i = -200000; i <= 200000; ++i){
+		x = i * 6e-5f;
+		err = fabs(dnn_tanh(x) - tanh(x));
+		if(!(err <= max_err))
+			max_err = err;
+	}
+	CHECK(max_err < 1e-6, "dnn_tanh is off by up to %g", max_err);
+}
+
+static void test_kernels(void)
+{
+	int s, k, j, i;
+	int n_in, n_rows;
+	double ref, mag;
+	float *w, *x, *out;
+
+	for(s = 0; s < 10 * EQ_SHAPES; ++s){
+		n_in = test_randint(1, 70);
+		n_rows = test_randint(1, 40);
+		w = malloc(sizeof *w * n_in * n_rows);
+		x = malloc(sizeof *x * n_in);
+		out = malloc(sizeof *out * n_rows);
+		test_fill(w, n_in * n_rows);
+		test_fill(x, n_in);
+
+		for(k = 0; k < DNN_N_KERNS; ++k){
+			dnn_mv_kerns[k](w, n_in, n_rows, x, out);
+			for(j = 0; j < n_rows; ++j){
+				ref = mag = 0;
+				for(i = 0; i < n_in; ++i){
+					ref += (double)w[j * n_in + i] * x[i];
+					mag += fabs((double)w[j * n_in + i] * x[i]);
+				}
+				CHECK(fabs(out[j] - ref) <= 1e-6 * mag + 1e-7,
+						"kernel %d, %d x %d row %d: %g want %g",
+						k, n_rows, n_in, j, out[j], ref);
+			}
+		}
+		free(w);
+		free(x);
+		free(out);
+	}
+}
+
+/* dnn_test() and dnn_evaluate() under every kernel and a few row blocks */
+static void test_forward_paths(void)
+{
+	static const int row_blocks[] = {0, 3, 8};
+	int s, k, r, i, j, b;
+	int n, n_in, n_out, guess, n_correct;
+	int *labels;
+	double loss, d;
+	float *out;
+	float **inputs;
+	struct dnn_net *net;
+	struct dnn_eval *ev;
+
+	for(s = 0; s < EQ_SHAPES; ++s){
+		net = test_net(test_randint(2, 4), 70);
+		if(s & 1)
+			dnn_set_output(net, DNN_OUT_SOFTMAX);
+		n_in = net->lay_sizes[0];
+		n_out = net->lay_sizes[net->num_lays - 1];
+		n = test_randint(1, 50);
+		inputs = malloc(sizeof *inputs * n);
+		labels = malloc(sizeof *labels * n);
+		out = malloc(sizeof *out * n_out);
+		for(b = 0; b < n; ++b){
+			inputs[b] = malloc(sizeof **inputs * n_in);
+			test_fill(inputs[b], n_in);
+			labels[b] = test_randint(0, n_out - 1);
+		}
+
+		for(k = 0; k < DNN_N_KERNS; ++k){
+			for(r = 0; r < 3; ++r){
+				for(i = 0; i < net->num_lays - 1; ++i){
+					net->lays[i].kern = k;
+					net->lays[i].row_block = row_blocks[r];
+				}
+				check_test(net, inputs[0], NULL, "dnn_test");
+
+				/* reference accuracy and loss from dnn_test() */
+				n_correct = 0;
+				loss = 0;
+				for(b = 0; b < n; ++b){
+					test_forward(net, inputs[b], out);
+					guess = 0;
+					for(j = 1; j < n_out; ++j)
+						if(out[j] > out[guess])
+							guess = j;
+					n_correct += guess == labels[b];
+					for(j = 0; j < n_out; ++j){
+						d = out[j] - (j == labels[b]);
+						loss += d * d;
+					}
+				}
+
+				ev = dnn_evaluate(net, inputs, labels, n, DNN_METRIC_MSE, 3);
+				CHECK(ev, "dnn_evaluate failed");
+				if(!ev)
+					continue;
+				/* near ties may go either way */
+				CHECK(abs(ev->n_correct - n_correct) <= n / 20,
+						"dnn_evaluate: %d correct, reference %d",
+						ev->n_correct, n_correct);
+				CHECK(test_close(ev->mean_loss, loss / n, EQ_ATOL, EQ_RTOL),
+						"dnn_evaluate: mean loss %g, reference %g",
+						ev->mean_loss, loss / n);
+				dnn_destroy_eval(ev);
+			}
+		}
+
+		for(b = 0; b < n; ++b)
+			free(inputs[b]);
+		free(inputs);
+		free(labels);
+		free(out);
+		dnn_destroy_net(net);
+	}
+}
+
+/* the intra-op group splits rows, each row is still one kernel call so
+ * the output can't change at all */
+static void test_intra(void)
+{
+	int s, i;
+	int lay_sizes[4];
+	float *inp, *want;
+	struct dnn_net *net;
+
+	for(s = 0; s < EQ_SHAPES / 4; ++s){
+		lay_sizes[0] = test_randint(100, 400);
+		lay_sizes[1] = test_randint(100, 600);
+		lay_sizes[2] = test_randint(1, 400);
+		lay_sizes[3] = test_randint(1, 20);
+		net = dnn_create_network(4, lay_sizes);
+		dnn_init_net(net);
+		for(i = 0; i < 3; ++i)
+			net->lays[i].kern = test_randint(0, DNN_N_KERNS - 1);
+		inp = malloc(sizeof *inp * lay_sizes[0]);
+		test_fill(inp, lay_sizes[0]);
+
+		want = dnn_test(net, inp);
+		CHECK(!dnn_set_intra_threads(test_randint(2, 5)), "dnn_set_intra_threads failed");
+		check_test(net, inp, want, "intra-op");
+		check_test(net, inp, want, "intra-op again");
+		dnn_set_intra_threads(0);
+
+		free(want);
+		free(inp);
+		dnn_destroy_net(net);
+	}
+}
+
+/* the asynchronous executor batches requests, again row for row */
+static void test_async(void)
+{
+	int i;
+	int n_in;
+	int lay_sizes[3];
+	float *inp[40], *want[40], *out;
+	struct dnn_net *net[2];
+	struct dnn_future *f[40];
+	struct dnn_executor *ex;
+
+	/* two nets taking the same input, so their requests interleave */
+	net[0] = test_net(3, 60);
+	lay_sizes[0] = net[0]->lay_sizes[0];
+	lay_sizes[1] = test_randint(1, 60);
+	lay_sizes[2] = test_randint(1, 10);
+	net[1] = dnn_create_network(3, lay_sizes);
+	dnn_init_net(net[1]);
+	n_in = net[0]->lay_sizes[0];
+
+	ex = dnn_create_executor(3, 4);
+	CHECK(ex, "dnn_create_executor failed");
+	for(i = 0; i < 40; ++i){
+		inp[i] = malloc(sizeof **inp * n_in);
+		test_fill(inp[i], n_in);
+		want[i] = dnn_test(net[i & 1], inp[i]);
+		f[i] = dnn_submit(ex, net[i & 1], inp[i]);
+	}
+	for(i = 0; i < 40; ++i){
+		out = dnn_wait(f[i]);
+		CHECK(out && !memcmp(out, want[i],
+					sizeof *out * net[i & 1]->lay_sizes[2]),
+				"async request %d differs", i);
+		free(out);
+		free(want[i]);
+		free(inp[i]);
+	}
+	dnn_destroy_executor(ex);
+	dnn_destroy_net(net[0]);
+	dnn_destroy_net(net[1]);
+}
+
+/* incremental first layer against full passes as the input drifts */
+static void test_incremental(void)
+{
+	int s, t, i;
+	int n_in, n_ch;
+	int idx[5];
+	float vals[5];
+	float *inp, *out, *ref;
+	struct dnn_net *net;
+	struct dnn_incremental *inc, *inc2;
+	float *wm_t;
+
+	for(s = 0; s < EQ_SHAPES / 4; ++s){
+		net = test_net(test_randint(2, 4), 60);
+		n_in = net->lay_sizes[0];
+		inp = malloc(sizeof *inp * n_in);
+		test_fill(inp, n_in);
+		inc = dnn_create_incremental(net, inp);
+		CHECK(inc, "dnn_create_incremental failed");
+		/* one transposed copy per net, shared by every context */
+		wm_t = net->lays[0].wm_t;
+		CHECK(wm_t, "dnn_create_incremental didn't pack the first layer");
+		inc2 = dnn_create_incremental(net, inp);
+		CHECK(inc2 && net->lays[0].wm_t == wm_t, "second context repacked the net");
+		dnn_destroy_incremental(inc2);
+
+		for(t = 0; t < 300; ++t){
+			n_ch = test_randint(0, 5);
+			for(i = 0; i < n_ch; ++i){
+				idx[i] = test_randint(0, n_in - 1);
+				vals[i] = test_randf();
+				inp[idx[i]] = vals[i];
+			}
+			out = dnn_inc_update(inc, n_ch, idx, vals);
+			CHECK(out, "dnn_inc_update failed");
+			if(!out)
+				break;
+			/* repeated indices in one update keep the last value,
+			 * as inp does */
+			ref = dnn_test(net, inp);
+			for(i = 0; i < net->lay_sizes[net->num_lays - 1]; ++i)
+				CHECK(test_close(out[i], ref[i], 1e-4f, 1e-4f),
+						"incremental output %d is %g, full pass %g",
+						i, out[i], ref[i]);
+			free(ref);
+		}
+
+		dnn_destroy_incremental(inc);
+		free(inp);
+		dnn_destroy_net(net);
+	}
+}
+
+/* a population against its members trained as separate networks */
+static void test_population(void)
+{
+	int s, m, t, i;
+	int n_memb, n_in, n_out;
+	float *inp[4], *want[4], *out, *ref;
+	struct dnn_net *net, *memb[5];
+	struct dnn_train *train[5][4];
+	struct dnn_population *pop;
+
+	for(s = 0; s < EQ_SHAPES / 4; ++s){
+		net = test_net(test_randint(2, 4), 30);
+		if(s & 1)
+			dnn_set_output(net, DNN_OUT_SOFTMAX);
+		n_in = net->lay_sizes[0];
+		n_out = net->lay_sizes[net->num_lays - 1];
+		n_memb = test_randint(1, 5);
+		pop = dnn_create_population(net, n_memb);
+		CHECK(pop, "dnn_create_population failed");
+		CHECK(dnn_pop_set_d_cost_func(pop, NULL) == -1, "population took a NULL cost");
+		dnn_init_population(pop);
+		for(m = 0; m < n_memb; ++m)
+			memb[m] = dnn_pop_export(pop, m);
+
+		for(t = 0; t < 4; ++t){
+			inp[t] = malloc(sizeof **inp * n_in);
+			want[t] = calloc(n_out, sizeof **want);
+			test_fill(inp[t], n_in);
+			if(s & 1)
+				want[t][test_randint(0, n_out - 1)] = 1;
+			else
+				test_fill(want[t], n_out);
+		}
+
+		/* one step of 4 examples both ways */
+		for(t = 0; t < 4; ++t)
+			dnn_pop_train(pop, inp[t], want[t]);
+		dnn_pop_apply(pop, 0.3f);
+		for(m = 0; m < n_memb; ++m){
+			for(t = 0; t < 4; ++t){
+				train[m][t] = dnn_create_train(memb[m]);
+				dnn_train(inp[t], want[t], train[m][t]);
+			}
+			dnn_apply(train[m], 4, 0.3f);
+		}
+
+		out = dnn_pop_test(pop, inp[0]);
+		for(m = 0; m < n_memb; ++m){
+			ref = dnn_test(memb[m], inp[0]);
+			for(i = 0; i < n_out; ++i)
+				CHECK(test_close(out[m * n_out + i], ref[i], 1e-5f, 1e-4f),
+						"member %d output %d is %g, separately %g",
+						m, i, out[m * n_out + i], ref[i]);
+			free(ref);
+			for(t = 0; t < 4; ++t)
+				dnn_destroy_train(train[m][t]);
+			dnn_destroy_net(memb[m]);
+		}
+		free(out);
+
+		for(t = 0; t < 4; ++t){
+			free(inp[t]);
+			free(want[t]);
+		}
+
+		/* members can't take trainable activations on import either */
+		dnn_set_act_aptx(net, 1, 0);
+		CHECK(dnn_pop_import(pop, 0, net) == -1, "imported a net with APTx");
+
+		dnn_destroy_population(pop);
+		dnn_destroy_net(net);
+	}
+}
+
+/* bf16 training against fp32, the update differs by bf16 rounding */
+static void test_bf16(void)
+{
+	int s, i, j, k;
+	int n_in, n_out;
+	float d32, d16, max_d;
+	float *inp, *want;
+	struct dnn_net *net, *copy;
+	struct dnn_train *train[2];
+
+	for(s = 0; s < EQ_SHAPES / 4; ++s){
+		net = test_net(test_randint(2, 4), 40);
+		copy = copy_net(net);
+		n_in = net->lay_sizes[0];
+		n_out = net->lay_sizes[net->num_lays - 1];
+		inp = malloc(sizeof *inp * n_in);
+		want = malloc(sizeof *want * n_out);
+		test_fill(inp, n_in);
+		test_fill(want, n_out);
+
+		train[0] = dnn_create_train(net);
+		train[1] = dnn_create_train(copy);
+		CHECK(!dnn_set_train_precision(train[1], DNN_PREC_BF16, 64),
+				"dnn_set_train_precision failed");
+		dnn_train(inp, want, train[0]);
+		dnn_train(inp, want, train[1]);
+
+		/* copy still holds the starting point until it is applied */
+		max_d = 0;
+		for(i = 0; i < net->num_lays - 1; ++i)
+			for(j = 0; j < net->lay_sizes[i + 1]; ++j)
+				for(k = 0; k < net->lay_sizes[i]; ++k)
+					if(fabsf(train[0]->d_lays[i + 1].d_wm[j][k]) > max_d)
+						max_d = fabsf(train[0]->d_lays[i + 1].d_wm[j][k]);
+
+		dnn_apply(&train[0], 1, 1);
+		dnn_apply(&train[1], 1, 1);
+		for(i = 0; i < net->num_lays - 1; ++i)
+			for(j = 0; j < net->lay_sizes[i + 1]; ++j)
+				for(k = 0; k < net->lay_sizes[i]; ++k){
+					d32 = -train[0]->d_lays[i + 1].d_wm[j][k];
+					d16 = copy->lays[i].wm[j][k] - net->lays[i].wm[j][k] + d32;
+					CHECK(fabsf(d16 - d32) <= 2e-2f * max_d + 1e-6f,
+							"bf16 weight step %g, fp32 %g", d16, d32);
+				}
+
+		dnn_destroy_train(train[0]);
+		dnn_destroy_train(train[1]);
+		free(inp);
+		free(want);
+		dnn_destroy_net(net);
+		dnn_destroy_net(copy);
+	}
+}
+
+/* factoring a layer whose weights have rank r loses nothing, and the
+ * factored forward pass matches the product of the factors */
+static void test_lowrank(void)
+{
+	int s, j, k, c;
+	int r, n_in, n_out;
+	int lay_sizes[3];
+	float *a, *b, *inp, *want, *out;
+	struct dnn_net *net, *copy;
+	struct dnn_dist *dist;
+
+	for(s = 0; s < EQ_SHAPES / 2; ++s){
+		lay_sizes[0] = n_in = test_randint(20, 80);
+		lay_sizes[1] = n_out = test_randint(20, 80);
+		lay_sizes[2] = test_randint(1, 10);
+		net = dnn_create_network(3, lay_sizes);
+		dnn_init_net(net);
+		r = test_randint(1, 6);
+		a = malloc(sizeof *a * n_out * r);
+		b = malloc(sizeof *b * r * n_in);
+		test_fill(a, n_out * r);
+		test_fill(b, r * n_in);
+		for(j = 0; j < n_out; ++j)
+			for(k = 0; k < n_in; ++k){
+				net->lays[0].wm[j][k] = 0;
+				for(c = 0; c < r; ++c)
+					net->lays[0].wm[j][k] += 0.1f * a[j * r + c] * b[c * n_in + k];
+			}
+
+		inp = malloc(sizeof *inp * n_in);
+		test_fill(inp, n_in);
+		want = dnn_test(net, inp);
+
+		/* not while a dnn_dist context addresses the dense weights */
+		dist = dnn_dist_create(net, 0, 1, NULL, 0);
+		CHECK(dist && dnn_compress_lowrank(net, 1, r, 0) == -1,
+				"compressed a net with a dnn_dist context");
+		dnn_dist_destroy(dist);
+
+		CHECK(dnn_compress_lowrank(net, 1, r, 0) == r, "compress to rank %d failed", r);
+		check_test(net, inp, NULL, "low rank");
+		out = dnn_test(net, inp);
+		for(j = 0; j < lay_sizes[2]; ++j)
+			CHECK(test_close(out[j], want[j], 1e-4f, 1e-3f),
+					"rank %d factorization output %d is %g, dense %g",
+					r, j, out[j], want[j]);
+		free(out);
+
+		/* and it survives a save and load */
+		free(want);
+		want = dnn_test(net, inp);
+		copy = copy_net(net);
+		check_test(copy, inp, want, "low rank reloaded");
+
+		dnn_destroy_net(copy);
+		free(want);
+		free(inp);
+		free(a);
+		free(b);
+		dnn_destroy_net(net);
+	}
+}
+
+/* everything else that hands out a network, the output must be the one
+ * dnn_test() gives */
+/* one rank of a two rank ring, rank 0 trains on one example and rank 1
+ * has no trains at all */
+struct dist_rank{
+	struct dnn_net *net;
+	int rank;
+	int port;
+	float *inp;
+	float *want;
+	int err;
+};
+
+static void *dist_rank_run(void *arg)
+{
+	struct dist_rank *r = arg;
+	struct dnn_dist *dist;
+	struct dnn_train *train;
+
+	r->err = -1;
+	dist = dnn_dist_create(r->net, r->rank, 2, "localhost", r->port);
+	if(!dist)
+		return NULL;
+	train = NULL;
+	if(r->rank == 0){
+		train = dnn_create_train(r->net);
+		dnn_dist_attach(dist, train);
+		dnn_train(r->inp, r->want, train);
+	}
+	r->err = dnn_dist_apply(dist, 0.1f);
+	dnn_dist_destroy(dist);
+	if(train)
+		dnn_destroy_train(train);
+
+	return NULL;
+}
+
+/* data parallel training against dnn_apply() of the same gradients */
+static void test_dist(void)
+{
+	int i, r;
+	int n_in, n_out;
+	float *inp, *want, *out, *ref;
+	pthread_t thr[2];
+	struct dist_rank ranks[2];
+	struct dnn_net *net;
+	struct dnn_train *train;
+
+	net = test_net(3, 30);
+	n_in = net->lay_sizes[0];
+	n_out = net->lay_sizes[2];
+	inp = malloc(sizeof *inp * n_in);
+	want = malloc(sizeof *want * n_out);
+	test_fill(inp, n_in);
+	test_fill(want, n_out);
+
+	for(r = 0; r < 2; ++r){
+		ranks[r].net = copy_net(net);
+		ranks[r].rank = r;
+		ranks[r].port = 20000 + getpid() % 20000;
+		ranks[r].inp = inp;
+		ranks[r].want = want;
+		pthread_create(&thr[r], NULL, dist_rank_run, &ranks[r]);
+	}
+	for(r = 0; r < 2; ++r)
+		pthread_join(thr[r], NULL);
+
+	train = dnn_create_train(net);
+	dnn_train(inp, want, train);
+	dnn_apply(&train, 1, 0.1f);
+	dnn_destroy_train(train);
+
+	ref = dnn_test(net, inp);
+	for(r = 0; r < 2; ++r){
+		CHECK(!ranks[r].err, "rank %d's dnn_dist_apply failed", r);
+		out = dnn_test(ranks[r].net, inp);
+		for(i = 0; i < n_out; ++i)
+			CHECK(test_close(out[i], ref[i], EQ_ATOL, EQ_RTOL),
+					"rank %d output %d is %g, dnn_apply %g",
+					r, i, out[i], ref[i]);
+		free(out);
+		dnn_destroy_net(ranks[r].net);
+	}
+
+	free(ref);
+	free(inp);
+	free(want);
+	dnn_destroy_net(net);
+}
+
+static void test_serving(void)
+{
+	char dir[] = "/tmp/danknn_storeXXXXXX";
+	char path[64];
+	int n_in;
+	float *inp, *want, *out;
+	FILE *fp;
+	struct dnn_net *net, *held;
+	struct dnn_model_handle *h;
+	struct dnn_model_store *st;
+
+	net = test_net(3, 40);
+	n_in = net->lay_sizes[0];
+	inp = malloc(sizeof *inp * n_in);
+	test_fill(inp, n_in);
+	want = dnn_test(net, inp);
+
+	/* a reload of the same net through the handle */
+	CHECK(!dnn_save_net(net, tmp_path), "dnn_save_net failed");
+	h = dnn_create_model_handle(copy_net(net), 4);
+	out = dnn_model_test(h, inp);
+	CHECK(out && !memcmp(out, want, sizeof *out * net->lay_sizes[2]), "model handle differs");
+	free(out);
+	CHECK(!dnn_model_reload(h, tmp_path), "dnn_model_reload failed");
+	while(dnn_model_reload_status(h) == 1)
+		usleep(1000);
+	CHECK(dnn_model_reload_status(h) == 0, "reload failed");
+	held = dnn_model_acquire(h);
+	check_test(held, inp, want, "reloaded model");
+	dnn_model_release(h, held);
+	dnn_destroy_model_handle(h);
+
+	/* a one model store */
+	CHECK(mkdtemp(dir), "mkdtemp failed");
+	snprintf(path, sizeof path, "%s/net", dir);
+	dnn_save_net(net, path);
+	st = dnn_create_model_store(dir, 1);
+	out = dnn_store_test(st, "net", inp);
+	CHECK(out && !memcmp(out, want, sizeof *out * net->lay_sizes[2]), "model store differs");
+	free(out);
+	CHECK(dnn_store_resident(st) == 0, "store kept an unheld net over budget");
+	CHECK(!dnn_store_get(st, "none"), "store found a missing net");
+	dnn_destroy_model_store(st);
+	unlink(path);
+	rmdir(dir);
+
+	/* a save file with an unknown output mode is refused, the mode
+	 * follows the magic number, layer count and layer sizes */
+	CHECK(!dnn_save_net(net, tmp_path), "dnn_save_net failed");
+	fp = fopen(tmp_path, "r+");
+	CHECK(fp, "can't reopen the save file");
+	if(fp){
+		fseek(fp, sizeof(float) + sizeof(int) * (1 + net->num_lays), SEEK_SET);
+		fputc(7, fp);
+		fclose(fp);
+		held = dnn_load_net(tmp_path);
+		CHECK(!held, "loaded a net with output mode 7");
+		if(held)
+			dnn_destroy_net(held);
+	}
+
+	free(want);
+	free(inp);
+	dnn_destroy_net(net);
+}
+
+int main(void)
+{
+	int fd;
+
+	/* no tuning cache, loaded nets keep the default kernels */
+	setenv("DNN_TUNE_CACHE", "/nonexistent/danknn.tune", 1);
+	fd = mkstemp(tmp_path);
+	if(fd < 0){
+		perror("mkstemp");
+		return 1;
+	}
+	close(fd);
+
+	test_tanh();
+	test_kernels();
+	test_forward_paths();
+	test_intra();
+	test_async();
+	test_incremental();
+	test_population();
+	test_bf16();
+	test_lowrank();
+	test_dist();
+	test_serving();
+
+	unlink(tmp_path);
+
+	return test_report("test_equiv");
+}
@@ -0,0 +1,342 @@
+/* sam's Dank Neural Network library (libdanknn)
+ *
+ * Copyright Sam Popham 2020
+ *
+ * this file is part of libdanknn
+ *
+ *  libdanknn is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* dnn_train()'s gradients against central finite differences of the cost,
+ * for every parameter and input of small random networks, and dnn_apply()
+ * against the update it should make */
+
+#include "test.h"
+
+#define GRAD_SHAPES	6
+#define GRAD_EPS	1e-2f
+#define GRAD_ATOL	2e-3f
+#define GRAD_RTOL	2e-2f
+
+/* the cost dnn_train() differentiates, sum of squared errors for
+ * DNN_OUT_ACT (d_cost is dnn_d_cost_mse()), cross entropy for softmax */
+static double cost(struct dnn_net *net, float *inp, const float *want)
+{
+	int i;
+	double c;
+	float *out;
+
+	out = dnn_test(net, inp);
+	c = 0;
+	for(i = 0; i < net->lay_sizes[net->num_lays - 1]; ++i){
+		if(net->out_mode == DNN_OUT_SOFTMAX)
+			c -= want[i] * log(out[i]);
+		else
+			c += (double)(out[i] - want[i]) * (out[i] - want[i]);
+	}
+	free(out);
+
+	return c;
+}
+
+/* checks the gradient g of the cost with respect to *p */
+static void check_one(struct dnn_net *net, float *inp, const float *want,
+		float *p, float g, const char *what, int lay, int idx)
+{
+	float save;
+	double c_hi, c_lo, num;
+
+	save = *p;
+	*p = save + GRAD_EPS;
+	c_hi = cost(net, inp, want);
+	*p = save - GRAD_EPS;
+	c_lo = cost(net, inp, want);
+	*p = save;
+
+	num = (c_hi - c_lo) / (2 * GRAD_EPS);
+	CHECK(test_close(g, num, GRAD_ATOL, GRAD_RTOL),
+			"%s layer %d [%d]: analytic %g numeric %g", what, lay, idx, g, num);
+}
+
+static void check_grads(struct dnn_net *net, struct dnn_train *train)
+{
+	int i, j, k;
+	int n_in, n_out;
+	float *inp, *want, *inp_grad;
+	struct dnn_layer *lay;
+	struct dnn_d_layer *d_lay;
+
+	n_in = net->lay_sizes[0];
+	n_out = net->lay_sizes[net->num_lays - 1];
+	inp = malloc(sizeof *inp * n_in);
+	want = calloc(n_out, sizeof *want);
+	test_fill(inp, n_in);
+	if(net->out_mode == DNN_OUT_SOFTMAX)
+		want[test_randint(0, n_out - 1)] = 1;
+	else
+		test_fill(want, n_out);
+
+	CHECK(!dnn_train(inp, want, train), "dnn_train failed");
+
+	for(i = 1; i < net->num_lays; ++i){
+		lay = &net->lays[i - 1];
+		d_lay = &train->d_lays[i];
+		n_in = net->lay_sizes[i - 1];
+		n_out = net->lay_sizes[i];
+		for(j = 0; j < n_out; ++j)
+			check_one(net, inp, want, &lay->bias[j], d_lay->d_bias[j], "bias", i, j);
+		if(lay->rank){
+			for(j = 0; j < n_out * lay->rank; ++j)
+				check_one(net, inp, want, &lay->lr_u[j], d_lay->d_lr_u[j], "lr_u", i, j);
+			for(j = 0; j < lay->rank * n_in; ++j)
+				check_one(net, inp, want, &lay->lr_v[j], d_lay->d_lr_v[j], "lr_v", i, j);
+		}else{
+			for(j = 0; j < n_out; ++j)
+				for(k = 0; k < n_in; ++k)
+					check_one(net, inp, want, &lay->wm[j][k], d_lay->d_wm[j][k],
+							"weight", i, j * n_in + k);
+		}
+		for(j = 0; j < 3 * lay->n_aptx; ++j)
+			check_one(net, inp, want, &lay->aptx[j], d_lay->d_aptx[j], "aptx", i, j);
+	}
+
+	inp_grad = get_input_gradient(train);
+	for(k = 0; k < net->lay_sizes[0]; ++k)
+		check_one(net, inp, want, &inp[k], inp_grad[k], "input", 0, k);
+
+	free(inp_grad);
+	free(inp);
+	free(want);
+}
+
+/* the library's default, swish everywhere */
+static void test_swish(void)
+{
+	int s;
+	struct dnn_net *net;
+	struct dnn_train *train;
+
+	for(s = 0; s < GRAD_SHAPES; ++s){
+		net = test_net(test_randint(2, 5), 9);
+		train = dnn_create_train(net);
+		check_grads(net, train);
+		dnn_destroy_train(train);
+		dnn_destroy_net(net);
+	}
+}
+
+/* fixed APTx through actv_func/d_actv_func */
+static void test_act_func(void)
+{
+	int s, i;
+	struct dnn_net *net;
+	struct dnn_train *train;
+
+	for(s = 0; s < GRAD_SHAPES; ++s){
+		net = test_net(test_randint(2, 4), 9);
+		for(i = 1; i < net->num_lays; ++i)
+			dnn_set_act_func(net, i, dnn_act_aptx);
+		train = dnn_create_train(net);
+		for(i = 1; i < net->num_lays; ++i)
+			dnn_set_d_act_func(train, i, dnn_d_act_aptx);
+		check_grads(net, train);
+		dnn_destroy_train(train);
+		dnn_destroy_net(net);
+	}
+}
+
+/* trainable APTx, per layer and per neuron, with moved parameters so
+ * mixing up alpha, beta and gamma shows */
+static void test_aptx(void)
+{
+	int s, i, j;
+	struct dnn_net *net;
+	struct dnn_train *train;
+
+	for(s = 0; s < GRAD_SHAPES; ++s){
+		net = test_net(test_randint(2, 4), 8);
+		for(i = 1; i < net->num_lays; ++i){
+			dnn_set_act_aptx(net, i, (i + s) & 1);
+			for(j = 0; j < 3 * net->lays[i - 1].n_aptx; ++j)
+				net->lays[i - 1].aptx[j] += 0.3f * test_randf();
+		}
+		train = dnn_create_train(net);
+		check_grads(net, train);
+		dnn_destroy_train(train);
+		dnn_destroy_net(net);
+	}
+}
+
+static void test_softmax(void)
+{
+	int s;
+	struct dnn_net *net;
+	struct dnn_train *train;
+
+	for(s = 0; s < GRAD_SHAPES; ++s){
+		net = test_net(test_randint(2, 4), 9);
+		dnn_set_output(net, DNN_OUT_SOFTMAX);
+		train = dnn_create_train(net);
+		check_grads(net, train);
+		dnn_destroy_train(train);
+		dnn_destroy_net(net);
+	}
+}
+
+/* a factored layer between two dense ones */
+static void test_lowrank(void)
+{
+	int s, r;
+	int lay_sizes[4];
+	struct dnn_net *net;
+	struct dnn_train *train;
+
+	for(s = 0; s < GRAD_SHAPES; ++s){
+		lay_sizes[0] = test_randint(2, 6);
+		lay_sizes[1] = test_randint(8, 14);
+		lay_sizes[2] = test_randint(8, 14);
+		lay_sizes[3] = test_randint(1, 5);
+		net = dnn_create_network(4, lay_sizes);
+		dnn_init_net(net);
+		r = test_randint(1, 3);
+		CHECK(dnn_compress_lowrank(net, 2, r, 0) == r, "compress to rank %d failed", r);
+		train = dnn_create_train(net);
+		check_grads(net, train);
+		dnn_destroy_train(train);
+		dnn_destroy_net(net);
+	}
+}
+
+/* each activation's gradient is the sum over every node it feeds, not
+ * just the last one */
+static void test_fan_out(void)
+{
+	int s, i, j, k;
+	int lay_sizes[4];
+	double sum;
+	float *inp, *want;
+	struct dnn_net *net;
+	struct dnn_train *train;
+
+	for(s = 0; s < GRAD_SHAPES; ++s){
+		for(i = 0; i < 4; ++i)
+			lay_sizes[i] = test_randint(2, 12);
+		net = dnn_create_network(4, lay_sizes);
+		dnn_init_net(net);
+		train = dnn_create_train(net);
+		inp = malloc(sizeof *inp * lay_sizes[0]);
+		want = malloc(sizeof *want * lay_sizes[3]);
+		test_fill(inp, lay_sizes[0]);
+		test_fill(want, lay_sizes[3]);
+		CHECK(!dnn_train(inp, want, train), "dnn_train failed");
+
+		for(i = 1; i < 4; ++i)
+			for(k = 0; k < lay_sizes[i - 1]; ++k){
+				sum = 0;
+				for(j = 0; j < lay_sizes[i]; ++j)
+					sum += (double)train->d_lays[i].d_wtd_sum[j] *
+						net->lays[i - 1].wm[j][k];
+				CHECK(test_close(train->d_lays[i - 1].d_act[k], sum, 1e-6f, 1e-5f),
+						"layer %d d_act[%d] is %g, sum over outputs %g",
+						i - 1, k, train->d_lays[i - 1].d_act[k], sum);
+			}
+
+		free(inp);
+		free(want);
+		dnn_destroy_train(train);
+		dnn_destroy_net(net);
+	}
+}
+
+/* dnn_apply() moves each parameter by -rate * the mean of its gradients */
+static void test_apply(void)
+{
+	int s, t, i, j, k;
+	int n_in, n_out, n_par;
+	float rate, want_w, *before, *inp, *out;
+	struct dnn_net *net;
+	struct dnn_train *train[3];
+
+	rate = 0.1f;
+	for(s = 0; s < GRAD_SHAPES; ++s){
+		net = test_net(test_randint(2, 4), 9);
+		n_in = net->lay_sizes[0];
+		n_out = net->lay_sizes[net->num_lays - 1];
+		inp = malloc(sizeof *inp * n_in);
+		out = malloc(sizeof *out * n_out);
+		for(t = 0; t < 3; ++t){
+			train[t] = dnn_create_train(net);
+			test_fill(inp, n_in);
+			test_fill(out, n_out);
+			dnn_train(inp, out, train[t]);
+		}
+
+		n_par = 0;
+		for(i = 1; i < net->num_lays; ++i)
+			n_par += net->lay_sizes[i] * (net->lay_sizes[i - 1] + 1);
+		before = malloc(sizeof *before * n_par);
+		n_par = 0;
+		for(i = 1; i < net->num_lays; ++i)
+			for(j = 0; j < net->lay_sizes[i]; ++j){
+				for(k = 0; k < net->lay_sizes[i - 1]; ++k)
+					before[n_par++] = net->lays[i - 1].wm[j][k];
+				before[n_par++] = net->lays[i - 1].bias[j];
+			}
+
+		dnn_apply(train, 3, rate);
+
+		n_par = 0;
+		for(i = 1; i < net->num_lays; ++i)
+			for(j = 0; j < net->lay_sizes[i]; ++j){
+				for(k = 0; k < net->lay_sizes[i - 1]; ++k){
+					want_w = before[n_par++] - rate / 3 *
+						(train[0]->d_lays[i].d_wm[j][k] +
+						 train[1]->d_lays[i].d_wm[j][k] +
+						 train[2]->d_lays[i].d_wm[j][k]);
+					CHECK(test_close(net->lays[i - 1].wm[j][k], want_w, 1e-6f, 1e-5f),
+							"applied weight %g want %g",
+							net->lays[i - 1].wm[j][k], want_w);
+					/* and the transposed copy followed */
+					CHECK(net->lays[i - 1].wm_t[k * net->lay_sizes[i] + j] ==
+							net->lays[i - 1].wm[j][k], "wm_t not repacked");
+				}
+				want_w = before[n_par++] - rate / 3 *
+					(train[0]->d_lays[i].d_bias[j] +
+					 train[1]->d_lays[i].d_bias[j] +
+					 train[2]->d_lays[i].d_bias[j]);
+				CHECK(test_close(net->lays[i - 1].bias[j], want_w, 1e-6f, 1e-5f),
+						"applied bias %g want %g", net->lays[i - 1].bias[j], want_w);
+			}
+
+		for(t = 0; t < 3; ++t)
+			dnn_destroy_train(train[t]);
+		free(before);
+		free(inp);
+		free(out);
+		dnn_destroy_net(net);
+	}
+}
+
+int main(void)
+{
+	test_swish();
+	test_act_func();
+	test_aptx();
+	test_softmax();
+	test_lowrank();
+	test_fan_out();
+	test_apply();
+
+	return test_report("test_grad");
+}